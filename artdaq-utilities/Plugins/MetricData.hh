@@ -2,10 +2,15 @@
 #define ARTDAQ_UTILITIES_PLUGINS_METRICDATA_HH
 
 #include <atomic>
+#include <cmath>
 #include <condition_variable>
+#include <cstdint>
 #include <limits>
 #include <list>
 #include <sstream>
+#include <vector>
+
+#include "artdaq-utilities/Plugins/QuantileSketch.hh"
 
 namespace artdaq {
 /// <summary>
@@ -35,6 +40,11 @@ enum class MetricMode : uint32_t
 	Minimum = 0x10,  ///< Reports the minimum value recorded.
 	Maximum = 0x20,  ///< Repots the maximum value recorded.
 	Persist = 0x40,  ///< Keep previous metric value in memory
+	Histogram = 0x80,  ///< Reports percentiles of the values recorded, using a fixed-size log-linear histogram. Use for latencies.
+	Quantiles = 0x100,  ///< Reports percentiles of the values recorded, using a mergeable QuantileSketch with bounded relative error.
+	StdDev = 0x200,     ///< Reports the standard deviation of the values recorded. Use for jitter.
+	Variance = 0x400,   ///< Reports the variance of the values recorded.
+	SmoothedRate = 0x800,  ///< Reports the rate as exponentially weighted moving averages over 1, 5 and 15 minutes. Use for stable rates at short reporting intervals.
 };
 /// <summary>
 /// Bitwise OR operator for MetricMode
@@ -57,6 +67,52 @@ constexpr MetricMode operator&(MetricMode a, MetricMode b)
 	return static_cast<MetricMode>(static_cast<uint32_t>(a) & static_cast<uint32_t>(b));
 }
 
+/// <summary>
+/// Bucket layout of the log-linear histogram used by MetricMode::Histogram
+///
+/// Each power of two between 2^MinExponent and 2^MaxExponent is split into SubBuckets linear buckets, so a value is
+/// located within 1/SubBuckets of its magnitude. Bucket 0 holds zero, negative values and values below 2^MinExponent;
+/// values above 2^MaxExponent are counted in the last bucket.
+/// </summary>
+struct MetricHistogram
+{
+	static constexpr int SubBuckets = 8;                                                   ///< Linear buckets per power of two
+	static constexpr int MinExponent = -24;                                                ///< Smallest power of two with its own buckets
+	static constexpr int MaxExponent = 40;                                                 ///< Power of two above the largest bucket
+	static constexpr size_t BucketCount = 1 + (MaxExponent - MinExponent) * SubBuckets;  ///< Total number of buckets
+
+	/// <summary>
+	/// Find the bucket holding a value
+	/// </summary>
+	/// <param name="value">Value to locate</param>
+	/// <returns>Index of the bucket containing value</returns>
+	static size_t BucketIndex(double value)
+	{
+		if (!(value >= std::ldexp(1.0, MinExponent))) return 0;  // Also catches NaN
+
+		int exponent = 0;
+		double mantissa = std::frexp(value, &exponent);  // value = mantissa * 2^exponent, mantissa in [0.5, 1)
+		int octave = exponent - 1 - MinExponent;
+		if (octave >= MaxExponent - MinExponent) return BucketCount - 1;
+
+		return 1 + static_cast<size_t>(octave) * SubBuckets + static_cast<size_t>((mantissa - 0.5) * 2 * SubBuckets);
+	}
+
+	/// <summary>
+	/// Get the value representing a bucket (its midpoint)
+	/// </summary>
+	/// <param name="index">Index of the bucket</param>
+	/// <returns>Representative value of the bucket</returns>
+	static double BucketValue(size_t index)
+	{
+		if (index == 0) return 0.0;
+
+		int octave = static_cast<int>((index - 1) / SubBuckets);
+		double sub = static_cast<double>((index - 1) % SubBuckets);
+		return std::ldexp(1.0 + (sub + 0.5) / SubBuckets, octave + MinExponent);
+	}
+};
+
 /// <summary>
 /// Small structure used to hold a metric data point before sending to the metric plugins
 /// </summary>
@@ -174,6 +230,22 @@ struct MetricData
 	/// Number of data points accumulated in this MetricData
 	/// </summary>
 	size_t DataPointCount{0};
+	/// <summary>
+	/// Bucket counts, if the metric is in MetricMode::Histogram (see MetricHistogram). Empty otherwise.
+	/// </summary>
+	std::vector<uint64_t> HistogramBuckets;
+	/// <summary>
+	/// Quantile sketch of the values recorded, if the metric is in MetricMode::Quantiles. Empty otherwise.
+	/// </summary>
+	QuantileSketch Sketch;
+	/// <summary>
+	/// Running mean of the values recorded, if the metric is in MetricMode::StdDev or MetricMode::Variance
+	/// </summary>
+	double Mean{0.0};
+	/// <summary>
+	/// Sum of squared deviations from Mean of the values recorded, if the metric is in MetricMode::StdDev or MetricMode::Variance
+	/// </summary>
+	double SumSquaredDeviations{0.0};
 
 	/// <summary>
 	/// Construct a MetricData point using a string value
@@ -201,7 +273,10 @@ struct MetricData
 	/// <param name="useNameOverride">Whether to override the default name</param>
 	MetricData(std::string const& name, int const& value, std::string const& unit, int level, MetricMode mode,
 	           std::string const& metricPrefix, bool useNameOverride)
-	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::IntMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1) {}
+	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::IntMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1)
+	{
+		initDistributions_(value);
+	}
 
 	/// <summary>
 	/// Construct a MetricData point using a double value
@@ -215,7 +290,10 @@ struct MetricData
 	/// <param name="useNameOverride">Whether to override the default name</param>
 	MetricData(std::string const& name, double const& value, std::string const& unit, int level, MetricMode mode,
 	           std::string const& metricPrefix, bool useNameOverride)
-	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::DoubleMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1) {}
+	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::DoubleMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1)
+	{
+		initDistributions_(value);
+	}
 
 	/// <summary>
 	/// Construct a MetricData point using a float value
@@ -229,7 +307,10 @@ struct MetricData
 	/// <param name="useNameOverride">Whether to override the default name</param>
 	MetricData(std::string const& name, float const& value, std::string const& unit, int level, MetricMode mode,
 	           std::string const& metricPrefix, bool useNameOverride)
-	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::FloatMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1) {}
+	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::FloatMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1)
+	{
+		initDistributions_(value);
+	}
 
 	/// <summary>
 	/// Construct a MetricData point using a uint64_t value
@@ -243,7 +324,27 @@ struct MetricData
 	/// <param name="useNameOverride">Whether to override the default name</param>
 	MetricData(std::string const& name, uint64_t const& value, std::string const& unit, int level,
 	           MetricMode mode, std::string const& metricPrefix, bool useNameOverride)
-	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::UnsignedMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1) {}
+	    : Name(name), Value(value), Last(value), Min(value), Max(value), Type(MetricType::UnsignedMetric), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride), DataPointCount(1)
+	{
+		initDistributions_(static_cast<double>(value));
+	}
+
+	/// <summary>
+	/// Construct an empty MetricData of the given type, with no data points
+	/// </summary>
+	/// <param name="name">Name of the metric</param>
+	/// <param name="type">Type of the metric</param>
+	/// <param name="unit">Units of the metric</param>
+	/// <param name="level">Reporting level of the metric</param>
+	/// <param name="mode">Accumulation mode of the metric</param>
+	/// <param name="metricPrefix">Name prefix for the metric</param>
+	/// <param name="useNameOverride">Whether to override the default name</param>
+	MetricData(std::string const& name, MetricType type, std::string const& unit, int level, MetricMode mode,
+	           std::string const& metricPrefix, bool useNameOverride)
+	    : Name(name), Type(type), Unit(unit), Level(level), Mode(mode), MetricPrefix(metricPrefix), UseNameOverride(useNameOverride)
+	{
+		Reset();
+	}
 
 	/// <summary>
 	/// Default constructor, constructs an MetricType::InvalidMetric
@@ -256,7 +357,7 @@ struct MetricData
 	/// </summary>
 	/// <param name="other">MetricData to add to this one</param>
 	/// <returns>True if the other MetricData is compatible and was added, false otherwise</returns>
-	bool Add(MetricData other)
+	bool Add(MetricData const& other)
 	{
 		if (other.Name == Name && other.Type == Type && other.Unit == Unit && other.Level == Level)
 		{
@@ -295,6 +396,10 @@ struct MetricData
 					case MetricType::InvalidMetric:
 						break;
 				}
+				HistogramBuckets = other.HistogramBuckets;
+				Sketch = other.Sketch;
+				Mean = other.Mean;
+				SumSquaredDeviations = other.SumSquaredDeviations;
 				DataPointCount = other.DataPointCount;
 				return true;
 			}
@@ -303,7 +408,14 @@ struct MetricData
 				switch (Type)
 				{
 					case MetricType::StringMetric:
-						StringValue += " " + other.StringValue;
+						if (Mode == MetricMode::LastPoint)
+						{
+							StringValue = other.StringValue;
+						}
+						else
+						{
+							StringValue += " " + other.StringValue;
+						}
 						break;
 					case MetricType::IntMetric:
 						Value.i += other.Value.i;
@@ -332,6 +444,15 @@ struct MetricData
 					case MetricType::InvalidMetric:
 						break;
 				}
+				if (HistogramBuckets.size() == other.HistogramBuckets.size())
+				{
+					for (size_t ii = 0; ii < HistogramBuckets.size(); ++ii)
+					{
+						HistogramBuckets[ii] += other.HistogramBuckets[ii];
+					}
+				}
+				Sketch.Merge(other.Sketch);
+				if (tracksMoments_()) mergeMoments_(other);
 				DataPointCount += other.DataPointCount;
 				return true;
 			}
@@ -350,6 +471,9 @@ struct MetricData
 		DataPointCount++;
 		if (point > Max.i) Max.i = point;
 		if (point < Min.i) Min.i = point;
+		if (!HistogramBuckets.empty()) HistogramBuckets[MetricHistogram::BucketIndex(static_cast<double>(point))]++;
+		if ((Mode & MetricMode::Quantiles) != MetricMode::None) Sketch.Add(static_cast<double>(point));
+		if (tracksMoments_()) addMoment_(static_cast<double>(point));
 	}
 	/// <summary>
 	/// Add a double point to this MetricData
@@ -362,6 +486,9 @@ struct MetricData
 		DataPointCount++;
 		if (point > Max.d) Max.d = point;
 		if (point < Min.d) Min.d = point;
+		if (!HistogramBuckets.empty()) HistogramBuckets[MetricHistogram::BucketIndex(static_cast<double>(point))]++;
+		if ((Mode & MetricMode::Quantiles) != MetricMode::None) Sketch.Add(static_cast<double>(point));
+		if (tracksMoments_()) addMoment_(static_cast<double>(point));
 	}
 	/// <summary>
 	/// Add a float point to this MetricData
@@ -374,6 +501,9 @@ struct MetricData
 		DataPointCount++;
 		if (point > Max.f) Max.f = point;
 		if (point < Min.f) Min.f = point;
+		if (!HistogramBuckets.empty()) HistogramBuckets[MetricHistogram::BucketIndex(static_cast<double>(point))]++;
+		if ((Mode & MetricMode::Quantiles) != MetricMode::None) Sketch.Add(static_cast<double>(point));
+		if (tracksMoments_()) addMoment_(static_cast<double>(point));
 	}
 	/// <summary>
 	/// Add an uint64_t point to this MetricData
@@ -386,6 +516,9 @@ struct MetricData
 		DataPointCount++;
 		if (point > Max.u) Max.u = point;
 		if (point < Min.u) Min.u = point;
+		if (!HistogramBuckets.empty()) HistogramBuckets[MetricHistogram::BucketIndex(static_cast<double>(point))]++;
+		if ((Mode & MetricMode::Quantiles) != MetricMode::None) Sketch.Add(static_cast<double>(point));
+		if (tracksMoments_()) addMoment_(static_cast<double>(point));
 	}
 
 	/// <summary>
@@ -427,8 +560,344 @@ struct MetricData
 			case MetricType::InvalidMetric:
 				break;
 		}
+		if ((Mode & MetricMode::Histogram) != MetricMode::None)
+		{
+			HistogramBuckets.assign(MetricHistogram::BucketCount, 0);
+		}
+		Sketch.Clear();
+		Mean = 0.0;
+		SumSquaredDeviations = 0.0;
 		DataPointCount = 0;
 	}
+
+	/// <summary>
+	/// Estimate a percentile of the values recorded in this MetricData, if it is in MetricMode::Histogram
+	/// </summary>
+	/// <param name="percentile">Percentile to estimate, from 0 to 100</param>
+	/// <returns>Estimated value of the percentile, clamped to the recorded minimum and maximum. 0 if there are no values.</returns>
+	double HistogramPercentile(double percentile) const
+	{
+		if (HistogramBuckets.empty() || DataPointCount == 0) return 0.0;
+
+		uint64_t total = 0;
+		for (auto count : HistogramBuckets) total += count;
+		if (total == 0) return 0.0;
+
+		auto rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(total)));
+		if (rank < 1) rank = 1;
+
+		uint64_t seen = 0;
+		size_t index = 0;
+		for (; index < HistogramBuckets.size() - 1; ++index)
+		{
+			seen += HistogramBuckets[index];
+			if (seen >= rank) break;
+		}
+
+		double value = MetricHistogram::BucketValue(index);
+		if (value < valueAsDouble_(Min)) value = valueAsDouble_(Min);
+		if (value > valueAsDouble_(Max)) value = valueAsDouble_(Max);
+		return value;
+	}
+
+	/// <summary>
+	/// Estimate a percentile of the values recorded in this MetricData, if it is in MetricMode::Quantiles
+	/// </summary>
+	/// <param name="percentile">Percentile to estimate, from 0 to 100</param>
+	/// <returns>Estimated value of the percentile, clamped to the recorded minimum and maximum. 0 if there are no values.</returns>
+	double SketchPercentile(double percentile) const
+	{
+		if (Sketch.Count() == 0 || DataPointCount == 0) return 0.0;
+
+		double value = Sketch.Quantile(percentile / 100.0);
+		if (value < valueAsDouble_(Min)) value = valueAsDouble_(Min);
+		if (value > valueAsDouble_(Max)) value = valueAsDouble_(Max);
+		return value;
+	}
+
+	/// <summary>
+	/// Get the variance of the values recorded in this MetricData, if it is in MetricMode::StdDev or MetricMode::Variance
+	/// </summary>
+	/// <returns>Population variance of the recorded values. 0 if there are no values.</returns>
+	double Variance() const
+	{
+		if (DataPointCount == 0) return 0.0;
+		return SumSquaredDeviations / static_cast<double>(DataPointCount);
+	}
+
+	/// <summary>
+	/// Get the standard deviation of the values recorded in this MetricData, if it is in MetricMode::StdDev or MetricMode::Variance
+	/// </summary>
+	/// <returns>Population standard deviation of the recorded values. 0 if there are no values.</returns>
+	double StdDev() const { return std::sqrt(Variance()); }
+
+private:
+	void initDistributions_(double value)
+	{
+		if ((Mode & MetricMode::Histogram) != MetricMode::None)
+		{
+			HistogramBuckets.assign(MetricHistogram::BucketCount, 0);
+			HistogramBuckets[MetricHistogram::BucketIndex(value)] = 1;
+		}
+		if ((Mode & MetricMode::Quantiles) != MetricMode::None)
+		{
+			Sketch.Add(value);
+		}
+		Mean = value;
+	}
+
+	bool tracksMoments_() const { return (Mode & (MetricMode::StdDev | MetricMode::Variance)) != MetricMode::None; }
+
+	// Welford's update, DataPointCount already includes the new point
+	void addMoment_(double point)
+	{
+		auto delta = point - Mean;
+		Mean += delta / static_cast<double>(DataPointCount);
+		SumSquaredDeviations += delta * (point - Mean);
+	}
+
+	// Chan et al.'s combination of the moments of two non-empty sets of values
+	void mergeMoments_(MetricData const& other)
+	{
+		auto count = static_cast<double>(DataPointCount);
+		auto otherCount = static_cast<double>(other.DataPointCount);
+		auto total = count + otherCount;
+		auto delta = other.Mean - Mean;
+		Mean += delta * otherCount / total;
+		SumSquaredDeviations += other.SumSquaredDeviations + delta * delta * count * otherCount / total;
+	}
+
+	double valueAsDouble_(MetricDataValue const& value) const
+	{
+		switch (Type)
+		{
+			case MetricType::IntMetric:
+				return value.i;
+			case MetricType::DoubleMetric:
+				return value.d;
+			case MetricType::FloatMetric:
+				return value.f;
+			case MetricType::UnsignedMetric:
+				return static_cast<double>(value.u);
+			default:
+				break;
+		}
+		return 0.0;
+	}
+};
+
+/// <summary>
+/// Accumulation state of a numeric metric, without the descriptive fields of MetricData
+///
+/// MetricManager keeps the name, units, level, mode and prefix of each metric once, in its registry, and accumulates
+/// values into one of these per metric id. It fits in a single cache line and can be copied without allocating. Metrics
+/// which need more state (string metrics, and MetricMode::Histogram, Quantiles, StdDev or Variance) are accumulated in a MetricData.
+/// </summary>
+struct alignas(64) MetricAccumulator
+{
+	MetricData::MetricDataValue Value;  ///< Accumulated value
+	MetricData::MetricDataValue Last;   ///< Last value
+	MetricData::MetricDataValue Min;    ///< Minimum value
+	MetricData::MetricDataValue Max;    ///< Maximum value
+	size_t DataPointCount{0};           ///< Number of values accumulated
+
+	/// <summary>
+	/// Returns whether a metric can be accumulated in a MetricAccumulator
+	/// </summary>
+	/// <param name="descriptor">MetricData describing the metric</param>
+	/// <returns>True if the metric is numeric, and does not use MetricMode::Histogram, Quantiles, StdDev or Variance</returns>
+	static bool Supports(MetricData const& descriptor)
+	{
+		return descriptor.Type != MetricType::StringMetric && descriptor.Type != MetricType::InvalidMetric &&
+		       (descriptor.Mode & (MetricMode::Histogram | MetricMode::Quantiles | MetricMode::StdDev | MetricMode::Variance)) == MetricMode::None;
+	}
+
+	/// <summary>
+	/// Reset this MetricAccumulator to the initial state for a type, as MetricData::Reset does
+	/// </summary>
+	/// <param name="type">Type of the metric</param>
+	void Reset(MetricType type)
+	{
+		switch (type)
+		{
+			case MetricType::IntMetric:
+				reset_(&MetricData::MetricDataValue::i);
+				break;
+			case MetricType::DoubleMetric:
+				reset_(&MetricData::MetricDataValue::d);
+				break;
+			case MetricType::FloatMetric:
+				reset_(&MetricData::MetricDataValue::f);
+				break;
+			case MetricType::UnsignedMetric:
+				reset_(&MetricData::MetricDataValue::u);
+				break;
+			default:
+				break;
+		}
+		DataPointCount = 0;
+	}
+
+	/// <summary>
+	/// Add an integer point to this MetricAccumulator
+	/// </summary>
+	/// <param name="point">Int value to add</param>
+	void AddPoint(int point) { addPoint_(&MetricData::MetricDataValue::i, point); }
+	/// <summary>
+	/// Add a double point to this MetricAccumulator
+	/// </summary>
+	/// <param name="point">Double value to add</param>
+	void AddPoint(double point) { addPoint_(&MetricData::MetricDataValue::d, point); }
+	/// <summary>
+	/// Add a float point to this MetricAccumulator
+	/// </summary>
+	/// <param name="point">Float value to add</param>
+	void AddPoint(float point) { addPoint_(&MetricData::MetricDataValue::f, point); }
+	/// <summary>
+	/// Add an uint64_t point to this MetricAccumulator
+	/// </summary>
+	/// <param name="point">uint64_t value to add</param>
+	void AddPoint(uint64_t point) { addPoint_(&MetricData::MetricDataValue::u, point); }
+
+	/// <summary>
+	/// Add the values in this MetricAccumulator to a MetricData, as MetricData::Add does
+	/// </summary>
+	/// <param name="data">MetricData of the same metric</param>
+	void AddTo(MetricData& data) const
+	{
+		if (DataPointCount == 0) return;
+		switch (data.Type)
+		{
+			case MetricType::IntMetric:
+				addTo_(data, &MetricData::MetricDataValue::i);
+				break;
+			case MetricType::DoubleMetric:
+				addTo_(data, &MetricData::MetricDataValue::d);
+				break;
+			case MetricType::FloatMetric:
+				addTo_(data, &MetricData::MetricDataValue::f);
+				break;
+			case MetricType::UnsignedMetric:
+				addTo_(data, &MetricData::MetricDataValue::u);
+				break;
+			default:
+				return;
+		}
+		data.DataPointCount += DataPointCount;
+	}
+
+private:
+	template<typename T>
+	void reset_(T MetricData::MetricDataValue::*member)
+	{
+		Value.*member = 0;
+		Last.*member = 0;
+		Min.*member = std::numeric_limits<T>::max();
+		Max.*member = std::numeric_limits<T>::min();
+	}
+
+	template<typename T>
+	void addPoint_(T MetricData::MetricDataValue::*member, T point)
+	{
+		Last.*member = point;
+		Value.*member += point;
+		DataPointCount++;
+		if (point > Max.*member) Max.*member = point;
+		if (point < Min.*member) Min.*member = point;
+	}
+
+	template<typename T>
+	void addTo_(MetricData& data, T MetricData::MetricDataValue::*member) const
+	{
+		if (data.DataPointCount == 0)
+		{
+			data.Value.*member = Value.*member;
+			data.Min.*member = Min.*member;
+			data.Max.*member = Max.*member;
+		}
+		else
+		{
+			data.Value.*member += Value.*member;
+			if (Min.*member < data.Min.*member) data.Min.*member = Min.*member;
+			if (Max.*member > data.Max.*member) data.Max.*member = Max.*member;
+		}
+		data.Last.*member = Last.*member;
+	}
+};
+
+/// <summary>
+/// Reusable storage for MetricData which are built, sent and discarded in each reporting cycle
+///
+/// Clear keeps the entries, and Add overwrites them in place, reusing the capacity of their strings, so once the pool
+/// has grown to the number of metrics in a cycle, refilling it does not allocate.
+/// </summary>
+class MetricDataPool
+{
+public:
+	/// <summary>
+	/// Add a MetricData holding one numeric value to the pool
+	/// </summary>
+	/// <param name="name">Name of the metric</param>
+	/// <param name="value">Value of the metric (int, double, float or uint64_t)</param>
+	/// <param name="unit">Units of the metric</param>
+	/// <param name="level">Reporting level of the metric</param>
+	/// <param name="mode">Accumulation mode of the metric</param>
+	/// <param name="metricPrefix">Name prefix for the metric</param>
+	/// <param name="useNameOverride">Whether to override the default name</param>
+	/// <returns>The pooled MetricData, valid until the next Clear</returns>
+	template<typename T>
+	MetricData& Add(std::string const& name, T const& value, std::string const& unit, int level, MetricMode mode,
+	                std::string const& metricPrefix, bool useNameOverride)
+	{
+		if (size_ == entries_.size())
+		{
+			entries_.emplace_back();
+		}
+		auto& entry = entries_[size_++];
+		entry.Name = name;
+		entry.Type = type_(value);
+		entry.Unit = unit;
+		entry.Level = level;
+		entry.Mode = mode;
+		entry.MetricPrefix = metricPrefix;
+		entry.UseNameOverride = useNameOverride;
+		entry.HistogramBuckets.clear();
+		entry.Reset();
+		entry.AddPoint(value);
+		return entry;
+	}
+
+	/// <summary>
+	/// Remove all MetricData from the pool, keeping their storage
+	/// </summary>
+	void Clear() { size_ = 0; }
+
+	/// <summary>
+	/// Get the number of MetricData in the pool
+	/// </summary>
+	/// <returns>The number of MetricData added since the last Clear</returns>
+	size_t Size() const { return size_; }
+
+	/// <summary>
+	/// Get the first MetricData in the pool
+	/// </summary>
+	/// <returns>Pointer to the first MetricData</returns>
+	MetricData* begin() { return entries_.data(); }
+
+	/// <summary>
+	/// Get the end of the MetricData in the pool
+	/// </summary>
+	/// <returns>Pointer past the last MetricData</returns>
+	MetricData* end() { return entries_.data() + size_; }
+
+private:
+	static MetricType type_(int) { return MetricType::IntMetric; }
+	static MetricType type_(double) { return MetricType::DoubleMetric; }
+	static MetricType type_(float) { return MetricType::FloatMetric; }
+	static MetricType type_(uint64_t) { return MetricType::UnsignedMetric; }
+
+	std::vector<MetricData> entries_;
+	size_t size_{0};
 };
 }  // namespace artdaq
 
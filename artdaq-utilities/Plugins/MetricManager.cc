@@ -14,9 +14,15 @@
 #include "fhiclcpp/ParameterSet.h"
 
 #include <pthread.h>
+#include <algorithm>
 #include <boost/exception/all.hpp>
 #include <chrono>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <type_traits>
+
+std::atomic<size_t> artdaq::MetricManager::next_instance_id_(1);
 
 artdaq::MetricManager::MetricManager()
     : metric_plugins_(0)
@@ -25,13 +31,28 @@ artdaq::MetricManager::MetricManager()
     , running_(false)
     , active_(false)
     , busy_(false)
-    , missed_metric_calls_(0)
-    , metric_calls_(0)
+    , instance_id_(next_instance_id_++)
 {
 	TLOG(TLVL_INFO) << "MetricManager CONSTRUCTOR";
 }
 
-artdaq::MetricManager::~MetricManager() noexcept { shutdown(); }
+artdaq::MetricManager::~MetricManager() noexcept
+{
+	shutdown();
+
+	// Threads keep a reference to their shard of this MetricManager until their next lookup of a shard (see localShard_).
+	// Release the accumulated values now, as that lookup may never happen.
+	std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+	for (auto& shard : metric_shards_)
+	{
+		std::lock_guard<std::mutex> slk(shard->mutex);
+		shard->orphaned = true;
+		for (auto& generation : shard->generations)
+		{
+			generation = MetricGeneration();
+		}
+	}
+}
 
 void artdaq::MetricManager::initialize(fhicl::ParameterSet const& pset, std::string const& prefix)
 {
@@ -45,6 +66,7 @@ void artdaq::MetricManager::initialize(fhicl::ParameterSet const& pset, std::str
 	std::vector<std::string> names = pset.get_names();
 
 	metric_plugins_.clear();
+	plugin_workers_.clear();
 	bool send_system_metrics = false;
 	bool send_process_metrics = false;
 
@@ -76,6 +98,14 @@ void artdaq::MetricManager::initialize(fhicl::ParameterSet const& pset, std::str
 			TLOG(TLVL_INFO) << "Setting metric_holdoff_us_ to " << pset.get<int>("metric_holdoff_us");
 			metric_holdoff_us_ = pset.get<int>("metric_holdoff_us");
 		}
+		else if (name == "numeric_overflow_policy")
+		{
+			numeric_overflow_policy_ = parseOverflowPolicy_(pset.get<std::string>("numeric_overflow_policy"), true);
+		}
+		else if (name == "string_overflow_policy")
+		{
+			string_overflow_policy_ = parseOverflowPolicy_(pset.get<std::string>("string_overflow_policy"), false);
+		}
 		else if (name == "send_system_metrics")
 		{
 			send_system_metrics = pset.get<bool>("send_system_metrics");
@@ -90,8 +120,19 @@ void artdaq::MetricManager::initialize(fhicl::ParameterSet const& pset, std::str
 			{
 				TLOG(TLVL_DEBUG + 32) << "Constructing metric plugin with name " << name;
 				auto plugin_pset = pset.get<fhicl::ParameterSet>(name);
-				metric_plugins_.push_back(
-				    makeMetricPlugin(plugin_pset.get<std::string>("metricPluginType", ""), plugin_pset, prefix_, name));
+
+				// Everything which can throw happens before either list is extended, so that they stay the same length
+				auto worker = std::make_unique<PluginWorker>();
+				worker->name = name;
+				worker->send_time_name = "Metric Plugin " + name + " Send Time";
+				worker->queue_depth_name = "Metric Plugin " + name + " Queue Depth";
+				worker->dropped_name = "Metric Plugin " + name + " Dropped Metrics";
+				worker->threaded = plugin_pset.get<bool>("use_worker_thread", false);
+				worker->queue_size = plugin_pset.get<size_t>("worker_queue_size", 1000);
+				auto plugin = makeMetricPlugin(plugin_pset.get<std::string>("metricPluginType", ""), plugin_pset, prefix_, name);
+
+				metric_plugins_.push_back(std::move(plugin));
+				plugin_workers_.push_back(std::move(worker));
 			}
 			catch (const cet::exception& e)
 			{
@@ -116,6 +157,34 @@ void artdaq::MetricManager::initialize(fhicl::ParameterSet const& pset, std::str
 		}
 	}
 
+	std::bitset<64> level_mask;
+	for (auto& metric : metric_plugins_)
+	{
+		level_mask |= metric->GetLevelMask();
+	}
+	level_mask_ = level_mask.to_ullong();
+
+	// Plugins driven by the Metric Sending thread with the same reporting interval aggregate values once, in the first of them
+	for (size_t ii = 0; ii < metric_plugins_.size(); ++ii)
+	{
+		auto& worker = *plugin_workers_[ii];
+		worker.leader = ii;
+		for (size_t jj = 0; jj < ii && !worker.threaded; ++jj)
+		{
+			auto& other = *plugin_workers_[jj];
+			if (!other.threaded && other.leader == jj && metric_plugins_[jj]->GetReportingInterval() == metric_plugins_[ii]->GetReportingInterval())
+			{
+				TLOG(TLVL_DEBUG + 32) << "Metric plugin " << worker.name << " shares the aggregate of metric plugin " << other.name;
+				metric_plugins_[ii]->shareAggregate(*metric_plugins_[jj]);
+				worker.leader = jj;
+				break;
+			}
+		}
+		auto& leader = *plugin_workers_[worker.leader];
+		leader.group.push_back(metric_plugins_[ii].get());
+		leader.group_levels |= metric_plugins_[ii]->GetLevelMask();
+	}
+
 	if (send_system_metrics || send_process_metrics)
 	{
 		system_metric_collector_ = std::make_unique<SystemMetricCollector>(send_process_metrics, send_system_metrics);
@@ -198,6 +267,7 @@ void artdaq::MetricManager::shutdown()
 	{
 		TRACE_STREAMER(TLVL_DEBUG + 32, TLOG2("MetricManager", 0), 0) << "MetricManager is initialized shutting down...";
 		initialized_ = false;
+		level_mask_ = 0;
 		for (auto& i : metric_plugins_)
 		{
 			try
@@ -213,74 +283,30 @@ void artdaq::MetricManager::shutdown()
 			}
 		}
 		metric_plugins_.clear();
+		plugin_workers_.clear();
 	}
 }
 
-void artdaq::MetricManager::sendMetric(std::string const& name, std::string const& value, std::string const& unit,
-                                       int level, MetricMode mode, std::string const& metricPrefix,
-                                       bool useNameOverride)
+artdaq::MetricManager::OverflowPolicy artdaq::MetricManager::parseOverflowPolicy_(std::string const& policy, bool numeric)
 {
-	if (!initialized_)
+	if (policy == "unbounded")
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
-		{
-			TLOG(TLVL_WARNING) << "Attempted to send metric " << name << " when MetricManager has not yet been initialized!";
-			last_failure_ = std::chrono::steady_clock::now();
-		}
+		return OverflowPolicy::Unbounded;
 	}
-	else if (!running_)
+	if (policy == "reservoir" && !numeric)
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
-		{
-			TLOG(TLVL_INFO) << "Attempted to send metric when MetricManager stopped!";
-			last_failure_ = std::chrono::steady_clock::now();
-		}
+		return OverflowPolicy::Reservoir;
 	}
-	else if (active_)
+	if (policy == "drop")
 	{
-		{
-			std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-			metric_calls_++;
-			last_metric_received_ = std::chrono::steady_clock::now();
-			auto& cached = metric_cache_[name];
-			if (cached == nullptr)
-			{
-				metric_cache_[name] = std::make_unique<MetricData>(name, value, unit, level, mode, metricPrefix, useNameOverride);
-			}
-			else
-			{
-				auto size = cached->DataPointCount;
-				if (size < metric_cache_max_size_)
-				{
-					if (size >= metric_cache_notify_size_)
-					{
-						TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << name
-						                      << ".";
-					}
-					if (mode == MetricMode::LastPoint)
-					{
-						cached->StringValue = value;
-						cached->DataPointCount = 1;
-					}
-					else
-					{
-						cached->StringValue += " " + value;
-						cached->DataPointCount++;
-					}
-				}
-				else
-				{
-					TLOG(TLVL_DEBUG + 36) << "Rejecting metric because queue full";
-					missed_metric_calls_++;
-				}
-			}
-		}
-		metric_cv_.notify_all();
+		return OverflowPolicy::Drop;
 	}
+	TLOG(TLVL_WARNING) << "Unknown " << (numeric ? "numeric" : "string") << "_overflow_policy \"" << policy << "\", using \""
+	                   << (numeric ? "unbounded" : "drop") << "\"";
+	return numeric ? OverflowPolicy::Unbounded : OverflowPolicy::Drop;
 }
 
-void artdaq::MetricManager::sendMetric(std::string const& name, int const& value, std::string const& unit, int level,
-                                       MetricMode mode, std::string const& metricPrefix, bool useNameOverride)
+bool artdaq::MetricManager::acceptingMetrics_(std::string const& name)
 {
 	if (!initialized_)
 	{
@@ -289,152 +315,183 @@ void artdaq::MetricManager::sendMetric(std::string const& name, int const& value
 			TLOG(TLVL_WARNING) << "Attempted to send metric " << name << " when MetricManager has not yet been initialized!";
 			last_failure_ = std::chrono::steady_clock::now();
 		}
+		return false;
 	}
-	else if (!running_)
+	if (!running_)
 	{
 		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
 		{
 			TLOG(TLVL_INFO) << "Attempted to send metric when MetricManager stopped!";
 			last_failure_ = std::chrono::steady_clock::now();
 		}
+		return false;
 	}
-	else if (active_)
+	return active_;
+}
+
+artdaq::MetricManager::MetricShard& artdaq::MetricManager::localShard_()
+{
+	// Keyed by instance_id_ so that each MetricManager gets its own shard in every thread
+	thread_local std::unordered_map<size_t, std::shared_ptr<MetricShard>> thread_shards;
+	thread_local size_t last_instance = 0;
+	thread_local MetricShard* last_shard = nullptr;
+
+	if (last_instance == instance_id_ && last_shard != nullptr)
 	{
-		{
-			std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-			metric_calls_++;
-			last_metric_received_ = std::chrono::steady_clock::now();
-			auto& cached = metric_cache_[name];
-			if (cached == nullptr)
-			{
-				metric_cache_[name] = std::make_unique<MetricData>(name, value, unit, level, mode, metricPrefix, useNameOverride);
-			}
-			else
-			{
-				auto size = cached->DataPointCount;
-				if (size < metric_cache_max_size_)
-				{
-					if (size >= metric_cache_notify_size_)
-					{
-						TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << name
-						                      << ".";
-					}
-					cached->AddPoint(value);
-				}
-				else
-				{
-					TLOG(TLVL_DEBUG + 36) << "Rejecting metric because queue full";
-					missed_metric_calls_++;
-				}
-			}
-		}
-		metric_cv_.notify_all();
+		return *last_shard;
+	}
+
+	// Instance ids are never reused, so the shards of destroyed MetricManagers would otherwise stay until the thread exits
+	for (auto it = thread_shards.begin(); it != thread_shards.end();)
+	{
+		it = it->second->orphaned ? thread_shards.erase(it) : std::next(it);
+	}
+
+	auto& shard = thread_shards[instance_id_];
+	if (shard == nullptr)
+	{
+		shard = std::make_shared<MetricShard>();
+		std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+		metric_shards_.push_back(shard);
+		TLOG(TLVL_DEBUG + 35) << "Created metric shard for new thread, there are now " << metric_shards_.size() << " shards";
 	}
+	last_instance = instance_id_;
+	last_shard = shard.get();
+	return *shard;
 }
 
-void artdaq::MetricManager::sendMetric(std::string const& name, double const& value, std::string const& unit, int level,
-                                       MetricMode mode, std::string const& metricPrefix, bool useNameOverride)
+artdaq::MetricHandle const& artdaq::MetricManager::localHandle_(MetricShard& shard, std::string const& name, MetricType type,
+                                                                std::string const& unit, int level, MetricMode mode,
+                                                                std::string const& metricPrefix, bool useNameOverride)
 {
-	if (!initialized_)
+	auto it = shard.handles.find(name);
+	if (it == shard.handles.end())
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
+		it = shard.handles.emplace(name, registerMetric(name, type, unit, level, mode, metricPrefix, useNameOverride)).first;
+	}
+	return it->second;
+}
+
+bool artdaq::MetricManager::addPoint_(MetricShard& shard, MetricGeneration& generation, size_t id, std::string const& value)
+{
+	auto& cached = generation.entries[id];
+	auto size = cached.DataPointCount;
+	if (string_overflow_policy_ == OverflowPolicy::Reservoir && cached.Mode != MetricMode::LastPoint)
+	{
+		// Values are kept separately, so that any of them can be replaced, and joined into StringValue at harvest
+		if (generation.samples.size() <= id)
 		{
-			TLOG(TLVL_WARNING) << "Attempted to send metric " << name << " when MetricManager has not yet been initialized!";
-			last_failure_ = std::chrono::steady_clock::now();
+			generation.samples.resize(id + 1);
 		}
+		auto& samples = generation.samples[id];
+		cached.DataPointCount++;
+		if (samples.size() < metric_cache_max_size_)
+		{
+			samples.push_back(value);
+		}
+		else
+		{
+			// Algorithm R: the n-th value replaces a random sample with probability metric_cache_max_size_ / n
+			auto slot = std::uniform_int_distribution<size_t>(0, cached.DataPointCount - 1)(shard.random);
+			if (slot < samples.size())
+			{
+				samples[slot] = value;
+			}
+		}
+		return true;
 	}
-	else if (!running_)
+
+	if (size < metric_cache_max_size_ || string_overflow_policy_ == OverflowPolicy::Unbounded)
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
+		if (size >= metric_cache_notify_size_ && size < metric_cache_max_size_)
 		{
-			TLOG(TLVL_INFO) << "Attempted to send metric when MetricManager stopped!";
-			last_failure_ = std::chrono::steady_clock::now();
+			TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << cached.Name
+			                      << ".";
 		}
+		if (cached.Mode == MetricMode::LastPoint || size == 0)
+		{
+			cached.StringValue = value;
+			cached.DataPointCount = 1;
+		}
+		else
+		{
+			cached.StringValue += " " + value;
+			cached.DataPointCount++;
+		}
+		return true;
 	}
-	else if (active_)
+
+	dropPoint_(generation, id);
+	return false;
+}
+
+template<typename Target, typename T>
+bool artdaq::MetricManager::addPoint_(MetricGeneration& generation, MetricData const& descriptor, size_t id, Target& cached, T const& value)
+{
+	auto size = cached.DataPointCount;
+	if (size < metric_cache_max_size_ || numeric_overflow_policy_ == OverflowPolicy::Unbounded)
 	{
+		if (size >= metric_cache_notify_size_ && size < metric_cache_max_size_)
 		{
-			std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-			metric_calls_++;
-			last_metric_received_ = std::chrono::steady_clock::now();
-			auto& cached = metric_cache_[name];
-			if (cached == nullptr)
-			{
-				metric_cache_[name] = std::make_unique<MetricData>(name, value, unit, level, mode, metricPrefix, useNameOverride);
-			}
-			else
-			{
-				auto size = cached->DataPointCount;
-				if (size < metric_cache_max_size_)
-				{
-					if (size >= metric_cache_notify_size_)
-					{
-						TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << name
-						                      << ".";
-					}
-					cached->AddPoint(value);
-				}
-				else
-				{
-					TLOG(TLVL_DEBUG + 36) << "Rejecting metric because queue full";
-					missed_metric_calls_++;
-				}
-			}
+			TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << descriptor.Name
+			                      << ".";
 		}
-		metric_cv_.notify_all();
+		cached.AddPoint(value);
+		return true;
 	}
+
+	dropPoint_(generation, id);
+	return false;
 }
 
-void artdaq::MetricManager::sendMetric(std::string const& name, float const& value, std::string const& unit, int level,
+void artdaq::MetricManager::dropPoint_(MetricGeneration& generation, size_t id)
+{
+	TLOG(TLVL_DEBUG + 36) << "Rejecting metric because queue full";
+	if (generation.dropped.size() <= id)
+	{
+		generation.dropped.resize(id + 1);
+	}
+	generation.dropped[id]++;
+}
+
+void artdaq::MetricManager::sendMetric(std::string const& name, std::string const& value, std::string const& unit,
+                                       int level, MetricMode mode, std::string const& metricPrefix,
+                                       bool useNameOverride)
+{
+	if (acceptingMetrics_(name) && IsLevelEnabled(level))
+	{
+		sendHandleMetric_(localHandle_(localShard_(), name, MetricType::StringMetric, unit, level, mode, metricPrefix, useNameOverride),
+		                  value, MetricType::StringMetric);
+	}
+}
+
+void artdaq::MetricManager::sendMetric(std::string const& name, int const& value, std::string const& unit, int level,
                                        MetricMode mode, std::string const& metricPrefix, bool useNameOverride)
 {
-	if (!initialized_)
+	if (acceptingMetrics_(name) && IsLevelEnabled(level))
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
-		{
-			TLOG(TLVL_WARNING) << "Attempted to send metric " << name << " when MetricManager has not yet been initialized!";
-			last_failure_ = std::chrono::steady_clock::now();
-		}
+		sendHandleMetric_(localHandle_(localShard_(), name, MetricType::IntMetric, unit, level, mode, metricPrefix, useNameOverride),
+		                  value, MetricType::IntMetric);
 	}
-	else if (!running_)
+}
+
+void artdaq::MetricManager::sendMetric(std::string const& name, double const& value, std::string const& unit, int level,
+                                       MetricMode mode, std::string const& metricPrefix, bool useNameOverride)
+{
+	if (acceptingMetrics_(name) && IsLevelEnabled(level))
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
-		{
-			TLOG(TLVL_INFO) << "Attempted to send metric when MetricManager stopped!";
-			last_failure_ = std::chrono::steady_clock::now();
-		}
+		sendHandleMetric_(localHandle_(localShard_(), name, MetricType::DoubleMetric, unit, level, mode, metricPrefix, useNameOverride),
+		                  value, MetricType::DoubleMetric);
 	}
-	else if (active_)
+}
+
+void artdaq::MetricManager::sendMetric(std::string const& name, float const& value, std::string const& unit, int level,
+                                       MetricMode mode, std::string const& metricPrefix, bool useNameOverride)
+{
+	if (acceptingMetrics_(name) && IsLevelEnabled(level))
 	{
-		{
-			std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-			metric_calls_++;
-			last_metric_received_ = std::chrono::steady_clock::now();
-			auto& cached = metric_cache_[name];
-			if (cached == nullptr)
-			{
-				metric_cache_[name] = std::make_unique<MetricData>(name, value, unit, level, mode, metricPrefix, useNameOverride);
-			}
-			else
-			{
-				auto size = cached->DataPointCount;
-				if (size < metric_cache_max_size_)
-				{
-					if (size >= metric_cache_notify_size_)
-					{
-						TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << name
-						                      << ".";
-					}
-					cached->AddPoint(value);
-				}
-				else
-				{
-					TLOG(TLVL_DEBUG + 36) << "Rejecting metric because queue full";
-					missed_metric_calls_++;
-				}
-			}
-		}
-		metric_cv_.notify_all();
+		sendHandleMetric_(localHandle_(localShard_(), name, MetricType::FloatMetric, unit, level, mode, metricPrefix, useNameOverride),
+		                  value, MetricType::FloatMetric);
 	}
 }
 
@@ -442,53 +499,173 @@ void artdaq::MetricManager::sendMetric(std::string const& name, uint64_t const&
                                        int level, MetricMode mode, std::string const& metricPrefix,
                                        bool useNameOverride)
 {
-	if (!initialized_)
+	if (acceptingMetrics_(name) && IsLevelEnabled(level))
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
-		{
-			TLOG(TLVL_WARNING) << "Attempted to send metric " << name << " when MetricManager has not yet been initialized!";
-			last_failure_ = std::chrono::steady_clock::now();
-		}
+		sendHandleMetric_(localHandle_(localShard_(), name, MetricType::UnsignedMetric, unit, level, mode, metricPrefix, useNameOverride),
+		                  value, MetricType::UnsignedMetric);
 	}
-	else if (!running_)
+}
+
+artdaq::MetricHandle artdaq::MetricManager::registerMetric(std::string const& name, MetricType type, std::string const& unit,
+                                                           int level, MetricMode mode, std::string const& metricPrefix,
+                                                           bool useNameOverride)
+{
+	std::lock_guard<std::mutex> lk(metric_registry_mutex_);
+	auto it = metric_ids_.find(name);
+	if (it == metric_ids_.end())
 	{
-		if (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_failure_).count() > 1000)
-		{
-			TLOG(TLVL_INFO) << "Attempted to send metric when MetricManager stopped!";
-			last_failure_ = std::chrono::steady_clock::now();
-		}
+		TLOG(TLVL_DEBUG + 35) << "Registering metric " << name << " with id " << metric_registry_.size();
+		it = metric_ids_.emplace(name, metric_registry_.size()).first;
+		metric_registry_.push_back(std::make_unique<MetricData>(name, type, unit, level, mode, metricPrefix, useNameOverride));
 	}
-	else if (active_)
+	else if (metric_registry_[it->second]->Type != type)
 	{
+		TLOG(TLVL_WARNING) << "Metric " << name << " is already registered with a different type, values of the requested type will be rejected!";
+	}
+	return MetricHandle(it->second, metric_registry_[it->second].get());
+}
+
+template<typename T>
+void artdaq::MetricManager::sendHandleMetric_(MetricHandle const& handle, T const& value, MetricType type)
+{
+	auto& shard = localShard_();
+	bool flush = false;
+	{
+		std::lock_guard<std::mutex> lk(shard.mutex);
+		auto& generation = shard.generations[shard.active];
+		generation.calls++;
+		shard.last_received = std::chrono::steady_clock::now();
+		if (handle.descriptor_->Type != type)
+		{
+			TLOG(TLVL_DEBUG + 36) << "Rejecting value for metric " << handle.descriptor_->Name << " because it does not match the registered type";
+			generation.missed_calls++;
+			return;
+		}
+
+		if (shard.seen.size() <= handle.id_)
+		{
+			shard.seen.resize(handle.id_ + 1);
+		}
+		if (!shard.seen[handle.id_])
 		{
-			std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-			metric_calls_++;
-			last_metric_received_ = std::chrono::steady_clock::now();
-			auto& cached = metric_cache_[name];
-			if (cached == nullptr)
+			// First value for this metric from this thread: plugins report new metrics immediately
+			shard.seen[handle.id_] = true;
+			flush = true;
+		}
+
+		auto entry = [&]() -> MetricData& {
+			if (generation.entries.size() <= handle.id_)
 			{
-				metric_cache_[name] = std::make_unique<MetricData>(name, value, unit, level, mode, metricPrefix, useNameOverride);
+				generation.entries.resize(handle.id_ + 1);
 			}
-			else
+			auto& cached = generation.entries[handle.id_];
+			if (cached.Type == MetricType::InvalidMetric)
 			{
-				auto size = cached->DataPointCount;
-				if (size < metric_cache_max_size_)
-				{
-					if (size >= metric_cache_notify_size_)
-					{
-						TLOG(TLVL_DEBUG + 35) << "Metric cache is at size " << size << " of " << metric_cache_max_size_ << " for metric " << name
-						                      << ".";
-					}
-					cached->AddPoint(value);
-				}
-				else
-				{
-					TLOG(TLVL_DEBUG + 36) << "Rejecting metric because queue full";
-					missed_metric_calls_++;
-				}
+				cached = *handle.descriptor_;
+			}
+			return cached;
+		};
+
+		size_t const* count = nullptr;
+		bool was_dirty = false;
+		bool added = false;
+		if constexpr (std::is_same_v<T, std::string>)
+		{
+			count = &entry().DataPointCount;
+			was_dirty = *count > 0;
+			added = addPoint_(shard, generation, handle.id_, value);
+		}
+		else if (MetricAccumulator::Supports(*handle.descriptor_))
+		{
+			// Only the values are accumulated here, the descriptor stays in the registry
+			if (generation.accumulators.size() <= handle.id_)
+			{
+				generation.accumulators.resize(handle.id_ + 1);
 			}
+			auto& accumulator = generation.accumulators[handle.id_];
+			if (accumulator.DataPointCount == 0)
+			{
+				accumulator.Reset(type);
+			}
+			count = &accumulator.DataPointCount;
+			was_dirty = *count > 0;
+			added = addPoint_(generation, *handle.descriptor_, handle.id_, accumulator, value);
+		}
+		else
+		{
+			auto& cached = entry();
+			count = &cached.DataPointCount;
+			was_dirty = *count > 0;
+			added = addPoint_(generation, *handle.descriptor_, handle.id_, cached, value);
+		}
+
+		if (!added)
+		{
+			generation.missed_calls++;
 		}
-		metric_cv_.notify_all();
+		else if (!was_dirty)
+		{
+			generation.dirty.push_back(handle.id_);
+		}
+		else if (*count == (metric_cache_max_size_ + 1) / 2 &&
+		         (type == MetricType::StringMetric ? string_overflow_policy_ : numeric_overflow_policy_) == OverflowPolicy::Drop)
+		{
+			// Drain before the cache starts rejecting points
+			flush = true;
+		}
+	}
+	if (flush)
+	{
+		requestFlush_();
+	}
+}
+
+void artdaq::MetricManager::requestFlush_()
+{
+	{
+		std::lock_guard<std::mutex> lk(metric_mutex_);
+		flush_requested_ = true;
+	}
+	metric_cv_.notify_all();
+}
+
+void artdaq::MetricManager::sendMetric(MetricHandle const& handle, std::string const& value)
+{
+	if (handle.Valid() && acceptingMetrics_(handle.descriptor_->Name) && IsLevelEnabled(handle.descriptor_->Level))
+	{
+		sendHandleMetric_(handle, value, MetricType::StringMetric);
+	}
+}
+
+void artdaq::MetricManager::sendMetric(MetricHandle const& handle, int const& value)
+{
+	if (handle.Valid() && acceptingMetrics_(handle.descriptor_->Name) && IsLevelEnabled(handle.descriptor_->Level))
+	{
+		sendHandleMetric_(handle, value, MetricType::IntMetric);
+	}
+}
+
+void artdaq::MetricManager::sendMetric(MetricHandle const& handle, double const& value)
+{
+	if (handle.Valid() && acceptingMetrics_(handle.descriptor_->Name) && IsLevelEnabled(handle.descriptor_->Level))
+	{
+		sendHandleMetric_(handle, value, MetricType::DoubleMetric);
+	}
+}
+
+void artdaq::MetricManager::sendMetric(MetricHandle const& handle, float const& value)
+{
+	if (handle.Valid() && acceptingMetrics_(handle.descriptor_->Name) && IsLevelEnabled(handle.descriptor_->Level))
+	{
+		sendHandleMetric_(handle, value, MetricType::FloatMetric);
+	}
+}
+
+void artdaq::MetricManager::sendMetric(MetricHandle const& handle, uint64_t const& value)
+{
+	if (handle.Valid() && acceptingMetrics_(handle.descriptor_->Name) && IsLevelEnabled(handle.descriptor_->Level))
+	{
+		sendHandleMetric_(handle, value, MetricType::UnsignedMetric);
 	}
 }
 
@@ -524,10 +701,11 @@ void artdaq::MetricManager::startMetricLoop_()
 
 bool artdaq::MetricManager::metricQueueEmpty()
 {
-	std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-	for (auto& cache_entry : metric_cache_)
+	std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+	for (auto& shard : metric_shards_)
 	{
-		if (cache_entry.second->DataPointCount > 0)
+		std::lock_guard<std::mutex> slk(shard->mutex);
+		if (!shard->generations[shard->active].dirty.empty())
 		{
 			return false;
 		}
@@ -540,12 +718,18 @@ bool artdaq::MetricManager::metricManagerBusy()
 {
 	bool pluginsBusy = false;
 
-	for (auto& p : metric_plugins_)
+	for (size_t ii = 0; ii < metric_plugins_.size() && !pluginsBusy; ++ii)
 	{
-		if (p->metricsPending())
+		auto& worker = *plugin_workers_[ii];
+		if (worker.threaded)
 		{
-			pluginsBusy = true;
-			break;
+			// The plugin belongs to its worker thread, use the state it recorded after its last send pass
+			std::lock_guard<std::mutex> lk(worker.mutex);
+			pluginsBusy = worker.busy || worker.send_requested || worker.pending || !worker.queue.empty();
+		}
+		else
+		{
+			pluginsBusy = metric_plugins_[ii]->metricsPending();
 		}
 	}
 
@@ -555,241 +739,570 @@ bool artdaq::MetricManager::metricManagerBusy()
 
 size_t artdaq::MetricManager::metricQueueSize(std::string const& name)
 {
-	std::lock_guard<std::mutex> lk(metric_cache_mutex_);
-	size_t size = 0;
-	if (name.empty())
+	auto id = std::numeric_limits<size_t>::max();
+	if (!name.empty())
 	{
-		for (auto& q : metric_cache_)
+		std::lock_guard<std::mutex> lk(metric_registry_mutex_);
+		auto it = metric_ids_.find(name);
+		if (it == metric_ids_.end())
 		{
-			size += q.second->DataPointCount;
+			return 0;
 		}
+		id = it->second;
 	}
-	else
+
+	size_t size = 0;
+	std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+	for (auto& shard : metric_shards_)
 	{
-		if (metric_cache_.count(name) != 0u)
+		std::lock_guard<std::mutex> slk(shard->mutex);
+		auto& generation = shard->generations[shard->active];
+		auto count = [&generation](size_t metric_id) -> size_t {
+			size_t points = 0;
+			if (metric_id < generation.accumulators.size())
+			{
+				points += generation.accumulators[metric_id].DataPointCount;
+			}
+			if (metric_id < generation.entries.size())
+			{
+				points += generation.entries[metric_id].DataPointCount;
+			}
+			return points;
+		};
+		if (name.empty())
+		{
+			for (auto dirty_id : generation.dirty)
+			{
+				size += count(dirty_id);
+			}
+		}
+		else
 		{
-			size = metric_cache_[name]->DataPointCount;
+			size += count(id);
 		}
 	}
 
 	return size;
 }
 
-void artdaq::MetricManager::sendMetricLoop_()
+std::chrono::steady_clock::time_point artdaq::MetricManager::lastMetricReceived_()
 {
-	TLOG(TLVL_INFO) << "sendMetricLoop_ START";
-	auto last_send_time = std::chrono::steady_clock::time_point();
-	while (running_)
+	auto last = std::chrono::steady_clock::time_point();
+	std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+	for (auto& shard : metric_shards_)
 	{
-		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: Entering Metric input wait loop";
-		while (metricQueueEmpty() && running_)
+		std::lock_guard<std::mutex> slk(shard->mutex);
+		if (shard->last_received > last)
 		{
-			std::unique_lock<std::mutex> lk(metric_mutex_);
-			metric_cv_.wait_for(lk, std::chrono::milliseconds(100));
-			auto now = std::chrono::steady_clock::now();
-			if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_send_time).count() >
-			    metric_send_interval_ms_)
+			last = shard->last_received;
+		}
+	}
+	return last;
+}
+
+void artdaq::MetricManager::harvestMetrics_(size_t& calls, size_t& missed)
+{
+	calls = 0;
+	missed = 0;
+	{
+		std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+		harvest_shards_ = metric_shards_;
+		for (auto& shard : harvest_shards_)
+		{
+			std::lock_guard<std::mutex> slk(shard->mutex);
+			shard->active ^= 1;
+		}
+	}
+
+	// Producers have moved on to the other generation, so the retired one can be read without the shard lock
+	for (auto& shard : harvest_shards_)
+	{
+		auto& retired = shard->generations[shard->active ^ 1];
+		calls += retired.calls;
+		missed += retired.missed_calls;
+		retired.calls = 0;
+		retired.missed_calls = 0;
+
+		auto size = std::max(retired.entries.size(), retired.accumulators.size());
+		if (harvest_totals_.size() < size)
+		{
+			harvest_totals_.resize(size);
+			harvest_names_.resize(size);
+			harvest_dropped_.resize(size);
+		}
+		for (auto id : retired.dirty)
+		{
+			auto& total = harvest_totals_[id];
+			if (total.Type == MetricType::InvalidMetric)
 			{
-				TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: Metric send interval exceeded: Sending metrics";
 				{
-					std::unique_lock<std::mutex> lk(metric_cache_mutex_);  // last_metric_received_ is protected by metric_cache_mutex_
-					if (std::chrono::duration_cast<std::chrono::microseconds>(now - last_metric_received_).count() < metric_holdoff_us_)
-					{
-						lk.unlock();
-						usleep(metric_holdoff_us_);
-					}
+					std::lock_guard<std::mutex> lk(metric_registry_mutex_);
+					total = *metric_registry_[id];
+				}
+				if (total.UseNameOverride)
+				{
+					harvest_names_[id] = total.Name;
+				}
+				else if (!total.MetricPrefix.empty())
+				{
+					harvest_names_[id] = prefix_ + "." + total.MetricPrefix + "." + total.Name;
 				}
-				for (auto& metric : metric_plugins_)
+				else
 				{
-					if (metric)
-					{
-						metric->sendMetrics();
-					}
+					harvest_names_[id] = prefix_ + "." + total.Name;
 				}
-				last_send_time = now;
 			}
-		}
-		{
-			std::unique_lock<std::mutex> lk(metric_cache_mutex_);  // last_metric_received_ is protected by metric_cache_mutex_
-			if (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - last_metric_received_).count() < metric_holdoff_us_)
+			if (total.DataPointCount == 0)
 			{
-				lk.unlock();
-				usleep(metric_holdoff_us_);
+				harvest_ids_.push_back(id);
+			}
+			if (id < retired.dropped.size())
+			{
+				harvest_dropped_[id] += retired.dropped[id];
+				retired.dropped[id] = 0;
+			}
+			if (id < retired.accumulators.size() && retired.accumulators[id].DataPointCount > 0)
+			{
+				retired.accumulators[id].AddTo(total);
+				retired.accumulators[id].DataPointCount = 0;
+				continue;
 			}
-		}
-
-		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: After Metric input wait loop";
-		busy_ = true;
-		auto processing_start = std::chrono::steady_clock::now();
-		auto temp_list = std::list<std::unique_ptr<MetricData>>();
-		{
-			std::lock_guard<std::mutex> lk(metric_cache_mutex_);
 
-			for (auto& q : metric_cache_)
+			auto& entry = retired.entries[id];
+			if (id < retired.samples.size() && !retired.samples[id].empty())
 			{
-				if (q.second != nullptr && q.second->DataPointCount > 0)
+				auto& samples = retired.samples[id];
+				entry.StringValue = samples[0];
+				for (size_t ii = 1; ii < samples.size(); ++ii)
 				{
-					temp_list.emplace_back(new MetricData(*q.second));
-					q.second->Reset();
+					entry.StringValue += " " + samples[ii];
 				}
+				samples.clear();
 			}
+			total.Add(entry);
+			entry.Reset();
 		}
+		retired.dirty.clear();
+	}
+	harvest_shards_.clear();
+
+	// Shards which are only referenced from here belong to threads which have exited. Keep them until the values the
+	// thread sent after the swap above have been harvested.
+	std::lock_guard<std::mutex> lk(metric_shards_mutex_);
+	metric_shards_.erase(std::remove_if(metric_shards_.begin(), metric_shards_.end(),
+	                                    [](std::shared_ptr<MetricShard> const& shard) {
+		                                    if (shard.use_count() != 1) return false;
+		                                    std::lock_guard<std::mutex> slk(shard->mutex);
+		                                    return shard->generations[shard->active].calls == 0;
+	                                    }),
+	                     metric_shards_.end());
+}
 
-		auto calls = metric_calls_.exchange(0);
-		temp_list.emplace_back(
-		    new MetricData("Metric Calls", calls, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false));
+void artdaq::MetricManager::processMetrics_(bool collect_system_metrics)
+{
+	size_t calls = 0;
+	size_t missed = 0;
+	harvestMetrics_(calls, missed);
 
-		auto missed = missed_metric_calls_.exchange(0);
-		temp_list.emplace_back(
-		    new MetricData("Missed Metric Calls", missed, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false));
+	TLOG(TLVL_DEBUG + 33) << "There are " << harvest_ids_.size() << " Metrics to process (" << calls << " calls, " << missed
+	                      << " missed)";
 
-		TLOG(TLVL_DEBUG + 33) << "There are " << temp_list.size() << " Metrics to process (" << calls << " calls, " << missed
-		                      << " missed)";
+	for (auto id : harvest_ids_)
+	{
+		auto& total = harvest_totals_[id];
+		// Present the prefixed name to the plugins without copying it
+		std::swap(total.Name, harvest_names_[id]);
+		sendToPlugins_(total);
+		std::swap(total.Name, harvest_names_[id]);
+		total.Reset();
+	}
 
-		if (system_metric_collector_ != nullptr)
+	internal_metrics_.Clear();
+	for (auto id : harvest_ids_)
+	{
+		if (harvest_dropped_[id] > 0)
+		{
+			internal_metrics_.Add(harvest_names_[id], harvest_dropped_[id], "points", harvest_totals_[id].Level,
+			                      MetricMode::Accumulate, "", true)
+			    .Name += " Dropped Points";
+			harvest_dropped_[id] = 0;
+		}
+	}
+	harvest_ids_.clear();
+
+	internal_metrics_.Add("Metric Calls", calls, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false);
+
+	internal_metrics_.Add("Missed Metric Calls", missed, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false);
+
+	for (auto& worker : plugin_workers_)
+	{
+		std::lock_guard<std::mutex> lk(worker->mutex);
+		// Always reported, so that these metrics share reporting deadlines with the other MetricManager metrics
+		auto send_time = worker->sends > 0 ? std::chrono::duration_cast<std::chrono::duration<double>>(worker->send_time).count() / worker->sends : 0.0;
+		internal_metrics_.Add(worker->send_time_name, send_time, "s", 4, MetricMode::Average | MetricMode::Maximum, "", false);
+		if (worker->threaded)
 		{
-			TLOG(TLVL_DEBUG + 33) << "Collecting System metrics (CPU, RAM, Network)";
-			auto systemMetrics = system_metric_collector_->SendMetrics();
-			for (auto& m : systemMetrics) { temp_list.emplace_back(std::move(m)); }
+			internal_metrics_.Add(worker->queue_depth_name, worker->max_depth, "metrics", 4, MetricMode::Maximum, "", false);
+			internal_metrics_.Add(worker->dropped_name, worker->dropped, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false);
 		}
+		worker->max_depth = worker->queue.size();
+		worker->dropped = 0;
+		worker->sends = 0;
+		worker->send_time = std::chrono::steady_clock::duration(0);
+	}
+
+	if (collect_system_metrics && system_metric_collector_ != nullptr)
+	{
+		TLOG(TLVL_DEBUG + 33) << "Collecting System metrics (CPU, RAM, Network)";
+		system_metric_collector_->SendMetrics(internal_metrics_);
+	}
 
-		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: Before processing temp_list";
-		while (!temp_list.empty())
+	TLOG(TLVL_DEBUG + 34) << "processMetrics_: Before processing " << internal_metrics_.Size() << " internal metrics";
+	for (auto& data : internal_metrics_)
+	{
+		if (data.Type == MetricType::InvalidMetric)
+		{
+			continue;
+		}
+		if (!data.UseNameOverride)
 		{
-			auto data_ = std::move(temp_list.front());
-			temp_list.pop_front();
-			if (data_->Type == MetricType::InvalidMetric)
+			// Built in a reused buffer, which is then exchanged with the pooled name, so neither allocates once grown
+			prefixed_name_ = prefix_;
+			prefixed_name_ += '.';
+			if (!data.MetricPrefix.empty())
 			{
-				continue;
+				prefixed_name_ += data.MetricPrefix;
+				prefixed_name_ += '.';
 			}
-			if (!data_->UseNameOverride)
+			prefixed_name_ += data.Name;
+			std::swap(data.Name, prefixed_name_);
+		}
+		sendToPlugins_(data);
+	}
+}
+
+void artdaq::MetricManager::sendToPlugins_(MetricData const& data)
+{
+	auto level = std::min(data.Level, 63);
+	for (size_t ii = 0; ii < metric_plugins_.size(); ++ii)
+	{
+		auto& metric = metric_plugins_[ii];
+		auto& worker = *plugin_workers_[ii];
+		// Plugins sharing an aggregate receive values through its leader
+		if (!metric || worker.leader != ii || (level >= 0 && !worker.group_levels[level]))
+		{
+			continue;
+		}
+
+		if (worker.threaded)
+		{
+			std::lock_guard<std::mutex> lk(worker.mutex);
+			if (worker.queue.size() >= worker.queue_size)
 			{
-				if (!data_->MetricPrefix.empty())
-				{
-					data_->Name = prefix_ + "." + data_->MetricPrefix + "." + data_->Name;
-				}
-				else
-				{
-					data_->Name = prefix_ + "." + data_->Name;
-				}
+				TLOG(TLVL_DEBUG + 36) << "Dropping metric " << data.Name << " because the queue for metric plugin " << worker.name << " is full";
+				worker.dropped++;
+				continue;
 			}
+			worker.queue.push_back(data);
+			worker.max_depth = std::max(worker.max_depth, worker.queue.size());
+			continue;
+		}
 
-			for (auto& metric : metric_plugins_)
+		// String metrics are not aggregated, so each plugin of the group sends them itself, at its own levels
+		if (data.Type == MetricType::StringMetric)
+		{
+			for (auto plugin : worker.group)
 			{
-				if (!metric)
+				if (!plugin->IsLevelEnabled(data.Level))
 				{
 					continue;
 				}
-				if (metric->IsLevelEnabled(data_->Level))
+				try
+				{
+					plugin->addMetricData(data);
+				}
+				catch (...)
 				{
-					try
-					{
-						metric->addMetricData(data_);
-						last_send_time = std::chrono::steady_clock::now();
-					}
-					catch (...)
-					{
-						TLOG(TLVL_ERROR) << "Error in MetricManager::sendMetric: error sending value to metric plugin with name "
-						                 << metric->getLibName();
-					}
+					TLOG(TLVL_ERROR) << "Error in MetricManager::sendMetric: error sending value to metric plugin with name "
+					                 << plugin->getLibName();
 				}
 			}
+			continue;
 		}
 
-		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: Before sending metrics";
-		for (auto& metric : metric_plugins_)
+		try
 		{
-			if (!metric)
-			{
-				continue;
-			}
-			metric->sendMetrics(false, processing_start);
+			metric->addMetricData(data);
+		}
+		catch (...)
+		{
+			TLOG(TLVL_ERROR) << "Error in MetricManager::sendMetric: error sending value to metric plugin with name "
+			                 << metric->getLibName();
 		}
+	}
+}
 
-		// Limit rate of metrics going to plugins
-		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: End of working loop";
-		busy_ = false;
-		usleep(10000);
+void artdaq::MetricManager::sendPluginMetrics_(size_t index, std::chrono::steady_clock::time_point interval_end)
+{
+	auto& worker = *plugin_workers_[index];
+	if (worker.threaded)
+	{
+		{
+			std::lock_guard<std::mutex> lk(worker.mutex);
+			worker.send_requested = true;
+			worker.interval_end = interval_end;
+		}
+		worker.cv.notify_all();
+		return;
 	}
 
-	busy_ = true;
-	auto temp_list = std::list<std::unique_ptr<MetricData>>();
+	if (worker.leader != index)
 	{
-		std::lock_guard<std::mutex> lk(metric_cache_mutex_);
+		return;
+	}
+
+	auto send_start = std::chrono::steady_clock::now();
+	MetricPlugin::sendMetrics(worker.group.data(), worker.group.size(), false, interval_end);
+	auto send_end = std::chrono::steady_clock::now();
 
-		for (auto& q : metric_cache_)
+	for (size_t ii = index; ii < plugin_workers_.size(); ++ii)
+	{
+		auto& member = *plugin_workers_[ii];
+		if (member.leader == index)
 		{
-			if (q.second != nullptr && q.second->DataPointCount > 0)
-			{
-				temp_list.emplace_back(new MetricData(*q.second));
-				q.second->Reset();
-			}
+			std::lock_guard<std::mutex> lk(member.mutex);
+			member.sends++;
+			member.send_time += send_end - send_start;
 		}
-		// metric_cache_.clear();
 	}
+}
 
-	auto calls = metric_calls_.exchange(0);
-	temp_list.emplace_back(
-	    new MetricData("Metric Calls", calls, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false));
+void artdaq::MetricManager::startPluginWorkers_()
+{
+	for (size_t ii = 0; ii < metric_plugins_.size(); ++ii)
+	{
+		auto& worker = *plugin_workers_[ii];
+		if (!metric_plugins_[ii] || !worker.threaded)
+		{
+			continue;
+		}
 
-	auto missed = missed_metric_calls_.exchange(0);
-	temp_list.emplace_back(
-	    new MetricData("Missed Metric Calls", missed, "metrics", 4, MetricMode::Accumulate | MetricMode::Rate, "", false));
+		{
+			std::lock_guard<std::mutex> lk(worker.mutex);
+			worker.running = true;
+			worker.send_requested = false;
+			worker.next_send_time = std::chrono::steady_clock::time_point();
+		}
+		TLOG(TLVL_DEBUG + 32) << "Starting worker thread for metric plugin " << worker.name;
+		try
+		{
+			worker.thread = boost::thread(boost::bind(&MetricManager::pluginWorkerLoop_, this, ii));
 
-	TLOG(TLVL_DEBUG + 33) << "There are " << temp_list.size() << " Metrics to process (" << calls << " calls, " << missed
-	                      << " missed)";
+			char tname[16];                                            // Size 16 - see man page pthread_setname_np(3) and/or prctl(2)
+			snprintf(tname, sizeof(tname) - 1, "%s", "MetricWorker");  // NOLINT
+			tname[sizeof(tname) - 1] = '\0';                           // assure term. snprintf is not too evil :)
+			pthread_setname_np(worker.thread.native_handle(), tname);
+		}
+		catch (const boost::exception& e)
+		{
+			TLOG(TLVL_ERROR) << "Caught boost::exception starting worker thread for metric plugin " << worker.name << ": "
+			                 << boost::diagnostic_information(e) << ", errno=" << errno << ". The plugin will be driven by the Metric Sending thread.";
+			worker.threaded = false;
+		}
+	}
+}
 
-	while (!temp_list.empty())
+void artdaq::MetricManager::stopPluginWorkers_()
+{
+	for (auto& worker : plugin_workers_)
 	{
-		auto data_ = std::move(temp_list.front());
-		temp_list.pop_front();
-		if (data_->Type == MetricType::InvalidMetric)
+		if (!worker->thread.joinable())
 		{
 			continue;
 		}
-		if (!data_->UseNameOverride)
 		{
-			if (!data_->MetricPrefix.empty())
+			std::lock_guard<std::mutex> lk(worker->mutex);
+			worker->running = false;
+		}
+		worker->cv.notify_all();
+		try
+		{
+			worker->thread.join();
+		}
+		catch (...)
+		{
+			// IGNORED
+		}
+		TLOG(TLVL_DEBUG + 32) << "Worker thread for metric plugin " << worker->name << " stopped.";
+	}
+}
+
+void artdaq::MetricManager::pluginWorkerLoop_(size_t index)
+{
+	auto& metric = metric_plugins_[index];
+	auto& worker = *plugin_workers_[index];
+	std::vector<MetricData> batch;
+
+	std::unique_lock<std::mutex> lk(worker.mutex);
+	while (true)
+	{
+		worker.cv.wait(lk, [&worker] { return worker.send_requested || !worker.running; });
+		// Metrics queued after a stop request are handed to the plugin before it is stopped
+		auto stopping = !worker.running;
+		auto interval_end = worker.interval_end;
+		std::swap(batch, worker.queue);
+		worker.send_requested = false;
+		worker.busy = true;
+		lk.unlock();
+
+		auto send_start = std::chrono::steady_clock::now();
+		for (auto& data : batch)
+		{
+			try
 			{
-				data_->Name = prefix_ + "." + data_->MetricPrefix + "." + data_->Name;
+				metric->addMetricData(data);
 			}
-			else
+			catch (...)
 			{
-				data_->Name = prefix_ + "." + data_->Name;
+				TLOG(TLVL_ERROR) << "Error in MetricManager::pluginWorkerLoop_: error sending value to metric plugin with name "
+				                 << metric->getLibName();
 			}
 		}
+		batch.clear();
 
-		for (auto& metric : metric_plugins_)
+		try
 		{
-			if (!metric)
+			if (stopping)
 			{
-				continue;
+				metric->stopMetrics();
+				TLOG(TLVL_DEBUG + 32) << "Metric Plugin " << metric->getLibName() << " stopped.";
 			}
-			if (metric->IsLevelEnabled(data_->Level))
+			else
 			{
-				try
-				{
-					metric->addMetricData(data_);
-					last_send_time = std::chrono::steady_clock::now();
-				}
-				catch (...)
-				{
-					TLOG(TLVL_ERROR) << "Error in MetricManager::sendMetric: error sending value to metric plugin with name "
-					                 << metric->getLibName();
-				}
+				metric->sendMetrics(false, interval_end);
 			}
 		}
+		catch (...)
+		{
+			TLOG(TLVL_ERROR) << "Exception caught in MetricManager::pluginWorkerLoop_, error sending metrics to plugin with name "
+			                 << metric->getLibName();
+		}
+		auto send_end = std::chrono::steady_clock::now();
+		auto pending = !stopping && metric->metricsPending();
+		auto next_send_time = metric->nextSendTime();
+
+		lk.lock();
+		worker.sends++;
+		worker.send_time += send_end - send_start;
+		worker.pending = pending;
+		worker.next_send_time = next_send_time;
+		worker.busy = false;
+		if (stopping)
+		{
+			break;
+		}
 	}
+}
 
-	for (auto& metric : metric_plugins_)
+std::chrono::steady_clock::time_point artdaq::MetricManager::nextSendTime_(std::chrono::steady_clock::time_point last_send_time)
+{
+	auto next = last_send_time + std::chrono::milliseconds(metric_send_interval_ms_);
+	for (size_t ii = 0; ii < metric_plugins_.size(); ++ii)
+	{
+		if (!metric_plugins_[ii])
+		{
+			continue;
+		}
+		// Plugins with a worker thread report their deadline after each send pass
+		auto& worker = *plugin_workers_[ii];
+		std::chrono::steady_clock::time_point plugin_next;
+		if (worker.threaded)
+		{
+			std::lock_guard<std::mutex> lk(worker.mutex);
+			plugin_next = worker.next_send_time;
+		}
+		else
+		{
+			plugin_next = metric_plugins_[ii]->nextSendTime();
+		}
+		// Deadlines at or before the last pass were handled by it (or belong to a plugin with a zero reporting_interval)
+		if (plugin_next > last_send_time)
+		{
+			next = std::min(next, plugin_next);
+		}
+	}
+	return next;
+}
+
+void artdaq::MetricManager::sendMetricLoop_()
+{
+	TLOG(TLVL_INFO) << "sendMetricLoop_ START";
+	// Output names depend on prefix_, which may have changed since the last run
+	harvest_totals_.clear();
+	harvest_names_.clear();
+	harvest_dropped_.clear();
+	startPluginWorkers_();
+	auto last_send_time = std::chrono::steady_clock::time_point();
+	while (running_)
+	{
+		auto next_send_time = nextSendTime_(last_send_time);
+		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: Waiting "
+		                      << std::chrono::duration_cast<std::chrono::microseconds>(next_send_time - std::chrono::steady_clock::now()).count()
+		                      << " us for next metric deadline";
+		bool flush = false;
+		{
+			std::unique_lock<std::mutex> lk(metric_mutex_);
+			metric_cv_.wait_until(lk, next_send_time, [this] { return flush_requested_ || !running_; });
+			flush = flush_requested_;
+			flush_requested_ = false;
+		}
+		if (!running_)
+		{
+			break;
+		}
+		if (flush)
+		{
+			// Give associated sendMetric calls a chance to land in the same interval
+			auto holdoff_end = lastMetricReceived_() + std::chrono::microseconds(metric_holdoff_us_);
+			std::unique_lock<std::mutex> lk(metric_mutex_);
+			metric_cv_.wait_until(lk, holdoff_end, [this] { return !running_; });
+		}
+
+		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: After Metric input wait loop";
+		busy_ = true;
+		auto processing_start = std::chrono::steady_clock::now();
+		processMetrics_(true);
+
+		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: Before sending metrics";
+		for (size_t ii = 0; ii < metric_plugins_.size(); ++ii)
+		{
+			if (!metric_plugins_[ii])
+			{
+				continue;
+			}
+			sendPluginMetrics_(ii, processing_start);
+		}
+
+		last_send_time = std::chrono::steady_clock::now();
+		TLOG(TLVL_DEBUG + 34) << "sendMetricLoop_: End of working loop";
+		busy_ = false;
+	}
+
+	busy_ = true;
+	processMetrics_(false);
+	stopPluginWorkers_();
+
+	for (size_t ii = 0; ii < metric_plugins_.size(); ++ii)
 	{
-		if (!metric)
+		auto& metric = metric_plugins_[ii];
+		auto& worker = *plugin_workers_[ii];
+		if (!metric || worker.threaded || worker.leader != ii)
 		{
 			continue;
 		}
 		try
 		{
-			metric->stopMetrics();
+			MetricPlugin::stopMetrics(worker.group.data(), worker.group.size());
 			TLOG(TLVL_DEBUG + 32) << "Metric Plugin " << metric->getLibName() << " stopped.";
 		}
 		catch (...)
@@ -26,12 +26,52 @@ class ParameterSet;
 #include <atomic>
 #include <boost/thread.hpp>
 #include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <random>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#ifndef ARTDAQ_METRIC_MAX_LEVEL
+/// Highest metric level compiled into ARTDAQ_SEND_METRIC and MetricManager::sendMetric<Level> calls. Set with the
+/// ARTDAQ_METRIC_MAX_LEVEL CMake variable; by default, all levels are compiled.
+#define ARTDAQ_METRIC_MAX_LEVEL 63
+#endif
 
 namespace artdaq {
 class MetricManager;
-}
+
+/// <summary>
+/// A reference to a metric registered with MetricManager::registerMetric. The name, unit, level, mode and prefix
+/// of the metric are resolved once at registration, so sending values through a MetricHandle does not need to hash
+/// or compare the metric name.
+/// </summary>
+class MetricHandle
+{
+public:
+	/// <summary>
+	/// Construct an invalid MetricHandle. Values sent through an invalid MetricHandle are ignored.
+	/// </summary>
+	MetricHandle() = default;
+
+	/// <summary>
+	/// Returns whether this MetricHandle refers to a registered metric
+	/// </summary>
+	/// <returns>True if this MetricHandle was returned by MetricManager::registerMetric</returns>
+	bool Valid() const { return descriptor_ != nullptr; }
+
+private:
+	friend class MetricManager;
+	MetricHandle(size_t id, MetricData const* descriptor)
+	    : id_(id), descriptor_(descriptor) {}
+
+	size_t id_{0};
+	MetricData const* descriptor_{nullptr};
+};
+}  // namespace artdaq
 
 /**
  * \brief The MetricManager class handles loading metric plugins and asynchronously sending metric data to them.
@@ -65,6 +105,22 @@ public:
 		    fhicl::Comment{"The maximum amount of time between metric send calls (will send 0s for metrics which have not "
 		                   "reported in this interval)"},
 		    15000};
+		/// "numeric_overflow_policy" (Default: "unbounded"): What to do with numeric values for a metric which has already received
+		/// metric_queue_size values in the current interval. "unbounded": keep aggregating them, "drop": discard them, reporting the number discarded
+		fhicl::Atom<std::string> numeric_overflow_policy{
+		    fhicl::Name{"numeric_overflow_policy"},
+		    fhicl::Comment{"What to do with numeric values for a metric which has already received metric_queue_size values in the current interval. "
+		                   "\"unbounded\": keep aggregating them, \"drop\": discard them, reporting the number discarded"},
+		    "unbounded"};
+		/// "string_overflow_policy" (Default: "drop"): What to do with string values for a metric which has already received
+		/// metric_queue_size values in the current interval. "unbounded": keep all of them, "reservoir": keep a uniform random sample
+		/// of metric_queue_size values, "drop": discard them, reporting the number discarded
+		fhicl::Atom<std::string> string_overflow_policy{
+		    fhicl::Name{"string_overflow_policy"},
+		    fhicl::Comment{"What to do with string values for a metric which has already received metric_queue_size values in the current interval. "
+		                   "\"unbounded\": keep all of them, \"reservoir\": keep a uniform random sample of metric_queue_size values, "
+		                   "\"drop\": discard them, reporting the number discarded"},
+		    "drop"};
 		/// "send_system_metrics": (Default: false): Whether to collect and send system metrics such as CPU usage, Memory usage and network activity.
 		fhicl::Atom<bool> send_system_metrics{fhicl::Name{"send_system_metrics"}, fhicl::Comment{"Whether to collect and send system metrics such as CPU usage, Memory usage and network activity."}, false};
 		/// "send_process_metrics" (Default: false): Whether to collect and send process CPU usage and Memory usage
@@ -115,11 +171,24 @@ public:
 	 *
 	 * The ParameterSet should be a collection of tables, each configuring a MetricPlugin.
 	 * See the MetricPlugin documentation for how to configure a MetricPlugin.
-	 * "metric_queue_size": (Default: 1000): The maximum number of metric entries which can be stored in the metric queue. If the queue is above this
-	 * size, new metric entries will be dropped until the plugins catch up.
+	 * "metric_queue_size": (Default: 1000): The maximum number of values which a metric can receive in one interval before its overflow policy applies.
+	 * A metric whose queue is half full is sent without waiting for the next reporting interval if its policy is "drop".
+	 * "numeric_overflow_policy": (Default: "unbounded"): Overflow policy for numeric metrics: "unbounded" or "drop"
+	 * "string_overflow_policy": (Default: "drop"): Overflow policy for string metrics: "unbounded", "reservoir" or "drop".
+	 * Values dropped from a metric are counted, and reported as the "<name> Dropped Points" metric.
 	 * "metric_queue_notify_size": (Default: 10): The number of metric entries in the list which will cause reports of the queue size to be printed.
 	 * "metric_send_maximum_delay_ms": (Default: 15000): The maximum amount of time between metric send calls (will send 0s for metrics which have not reported in this interval)
-	 * "metric_holdoff_us": (Default: 1000): Amount of time, in microseconds, to delay sending metrics after each sendMetric call (to ensure that multiple associated calls are in the same metrics interval)
+	 * "metric_holdoff_us": (Default: 1000): Amount of time, in microseconds, to delay an immediate send after the last sendMetric call (to ensure that multiple associated calls are in the same metrics interval)
+	 *
+	 * The metric sending thread sleeps until the earliest reporting deadline of the configured MetricPlugin instances, or until a metric
+	 * which cannot wait for that deadline (a new metric, or one with a half-full queue) is received.
+	 *
+	 * A MetricPlugin configured with "use_worker_thread: true" is driven by its own thread, which receives metrics through a queue
+	 * of at most "worker_queue_size" entries, so that a slow back-end does not delay the other plugins. The queue depth, dropped
+	 * metrics and send time of each plugin are reported as level 4 metrics.
+	 *
+	 * The other plugins are grouped by reporting interval. The plugins in a group share one aggregate, so each value is
+	 * aggregated once however many of them report it.
 	 */
 	void initialize(fhicl::ParameterSet const& pset, std::string const& prefix = "");
 
@@ -237,6 +306,82 @@ public:
 	void sendMetric(std::string const& name, uint64_t const& value, std::string const& unit, int level,
 	                MetricMode mode, std::string const& metricPrefix = "", bool useNameOverride = false);
 
+	/**
+	 * \brief Send a metric whose level is known at compile time. If Level is above ARTDAQ_METRIC_MAX_LEVEL, the call compiles to nothing.
+	 * \tparam Level The verbosity level of the metric. Higher number == more verbose
+	 * \tparam T The type of the value, one of the types accepted by the other sendMetric overloads
+	 * \param name The Name of the metric
+	 * \param value The value of the metric
+	 * \param unit The units of the metric
+	 * \param mode The MetricMode that the metric should operate in
+	 * \param metricPrefix An additional prefix to prepend to the metric name
+	 * \param useNameOverride Whether to use name verbatim and not apply prefixes
+	 *
+	 * The arguments are still constructed by the caller; use ARTDAQ_SEND_METRIC to avoid that as well.
+	 */
+	template<int Level, typename T>
+	void sendMetric(std::string const& name, T const& value, std::string const& unit, MetricMode mode,
+	                std::string const& metricPrefix = "", bool useNameOverride = false)
+	{
+		if constexpr (Level <= ARTDAQ_METRIC_MAX_LEVEL)
+		{
+			sendMetric(name, value, unit, Level, mode, metricPrefix, useNameOverride);
+		}
+	}
+
+	/**
+	 * \brief Register a metric with the MetricManager, returning a MetricHandle which can be used to send values to it
+	 * \param name The Name of the metric
+	 * \param type The MetricType of the values which will be sent to the metric
+	 * \param unit The units of the metric
+	 * \param level The verbosity level of the metric. Higher number == more verbose
+	 * \param mode The MetricMode that the metric should operate in
+	 * \param metricPrefix An additional prefix to prepend to the metric name
+	 * \param useNameOverride Whether to use name verbatim and not apply prefixes
+	 * \return A MetricHandle referring to the metric
+	 *
+	 * Registration may be performed before initialize() is called, and handles remain valid across reinitialize() for
+	 * the lifetime of the MetricManager. If a metric with the same name has already been registered (or sent), a handle
+	 * to the existing metric is returned and its original unit, level and mode are retained.
+	 */
+	MetricHandle registerMetric(std::string const& name, MetricType type, std::string const& unit, int level,
+	                            MetricMode mode, std::string const& metricPrefix = "", bool useNameOverride = false);
+
+	/**
+	 * \brief Send a value to a metric registered with registerMetric
+	 * \param handle MetricHandle returned by registerMetric
+	 * \param value The value of the metric
+	 */
+	void sendMetric(MetricHandle const& handle, std::string const& value);
+
+	/**
+	 * \brief Send a value to a metric registered with registerMetric
+	 * \param handle MetricHandle returned by registerMetric
+	 * \param value The value of the metric
+	 */
+	void sendMetric(MetricHandle const& handle, int const& value);
+
+	/**
+	 * \brief Send a value to a metric registered with registerMetric
+	 * \param handle MetricHandle returned by registerMetric
+	 * \param value The value of the metric
+	 */
+	void sendMetric(MetricHandle const& handle, double const& value);
+
+	/**
+	 * \brief Send a value to a metric registered with registerMetric
+	 * \param handle MetricHandle returned by registerMetric
+	 * \param value The value of the metric
+	 */
+	void sendMetric(MetricHandle const& handle, float const& value);
+
+	/**
+	 * \brief Send a value to a metric registered with registerMetric
+	 * \param handle MetricHandle returned by registerMetric
+	 * \param value The value of the metric
+	 */
+	void sendMetric(MetricHandle const& handle, uint64_t const& value);
+
 	/**
 	 * \brief Sets the prefix prepended to all metrics without useNameOverride set
 	 * \param prefix The prefix to prepend. Delimiter character in names is "."
@@ -261,6 +406,19 @@ public:
 	/// <returns>True if a Metric Plugin can accept metrics</returns>
 	bool Active() { return active_; }
 
+	/// <summary>
+	/// Returns whether any Metric Plugin accepts metrics of the given level. sendMetric discards metrics of other
+	/// levels immediately; callers can use this to avoid computing values which would be discarded.
+	/// </summary>
+	/// <param name="level">The verbosity level of the metric</param>
+	/// <returns>True if a Metric Plugin accepts metrics of this level</returns>
+	bool IsLevelEnabled(int level) const
+	{
+		if (level > 63) level = 63;
+		if (level < 0) return true;
+		return ((level_mask_.load(std::memory_order_relaxed) >> level) & 1) != 0;
+	}
+
 	/// <summary>
 	/// Returns whether the metric queue is completely empty
 	/// </summary>
@@ -283,31 +441,171 @@ public:
 private:
 	void sendMetricLoop_();
 
+	/// One accumulation buffer of a MetricShard.
+	struct MetricGeneration
+	{
+		std::vector<MetricAccumulator> accumulators;    ///< Accumulated values of numeric metrics, indexed by metric id
+		std::vector<MetricData> entries;                ///< Accumulated values of other metrics (see MetricAccumulator::Supports), indexed by metric id
+		std::vector<size_t> dirty;                      ///< Ids of metrics which have received values since the last harvest
+		std::vector<size_t> dropped;                    ///< Values discarded by the "drop" overflow policy, indexed by metric id
+		std::vector<std::vector<std::string>> samples;  ///< Values kept by the "reservoir" overflow policy, indexed by metric id
+		size_t calls{0};                                ///< Number of sendMetric calls since the last harvest
+		size_t missed_calls{0};                         ///< Number of rejected sendMetric calls since the last harvest
+	};
+
+	/// Per-thread accumulation state. Each thread calling sendMetric accumulates into its own shard. The shard holds two
+	/// generations: the owning thread writes to the active one, and sendMetricLoop_ swaps them when it harvests, then
+	/// reads the retired generation without holding the shard lock.
+	struct MetricShard
+	{
+		std::mutex mutex;                                       ///< Protects active, last_received and the active generation
+		MetricGeneration generations[2];                        ///< Accumulation buffers
+		size_t active{0};                                       ///< Index of the generation receiving new values
+		std::chrono::steady_clock::time_point last_received;    ///< Time of the last sendMetric call
+		std::unordered_map<std::string, MetricHandle> handles;  ///< Name lookup cache, only used by the owning thread
+		std::minstd_rand random;                                ///< Random numbers for the "reservoir" overflow policy
+		std::vector<bool> seen;                                 ///< Whether this thread has sent each metric, indexed by metric id
+		std::atomic<bool> orphaned{false};                      ///< Set when the MetricManager is destroyed, so that the thread drops the shard
+	};
+
+	/// What to do with values for a metric which has already received metric_cache_max_size_ values in the current interval
+	enum class OverflowPolicy
+	{
+		Unbounded,  ///< Accept the value
+		Reservoir,  ///< Keep a uniform random sample of metric_cache_max_size_ values (string metrics only)
+		Drop        ///< Discard the value, and count it
+	};
+
+	static OverflowPolicy parseOverflowPolicy_(std::string const& policy, bool numeric);
+
+	/// Per-plugin sending state. Plugins configured with use_worker_thread are driven by their own thread: sendMetricLoop_
+	/// hands metrics to it through a bounded queue and requests a send pass, but never waits for the plugin.
+	struct PluginWorker
+	{
+		std::string name;                                      ///< Name of the plugin's configuration table
+		std::string send_time_name;                            ///< Name of the plugin's Send Time metric
+		std::string queue_depth_name;                          ///< Name of the plugin's Queue Depth metric
+		std::string dropped_name;                              ///< Name of the plugin's Dropped Metrics metric
+		bool threaded{false};                                  ///< Whether the plugin is driven by its own thread
+		size_t leader{0};                                      ///< Index of the plugin owning the aggregate this plugin uses
+		std::vector<MetricPlugin*> group;                      ///< Plugins using this plugin's aggregate, including itself, if it is a leader
+		std::bitset<64> group_levels;                          ///< Union of the level masks of group
+		size_t queue_size{1000};                               ///< Maximum number of metrics waiting for the worker thread
+		boost::thread thread;                                  ///< Worker thread, if threaded
+		std::mutex mutex;                                      ///< Protects the members below
+		std::condition_variable cv;                            ///< Signals the worker thread
+		std::vector<MetricData> queue;                         ///< Metrics waiting for the worker thread
+		bool running{false};                                   ///< Whether the worker thread should keep running
+		bool send_requested{false};                            ///< Whether sendMetricLoop_ has requested a send pass
+		bool busy{false};                                      ///< Whether the worker thread is in a send pass
+		bool pending{false};                                   ///< Result of metricsPending() after the last send pass
+		std::chrono::steady_clock::time_point interval_end;    ///< Interval end time for the requested send pass
+		std::chrono::steady_clock::time_point next_send_time;  ///< Result of nextSendTime() after the last send pass
+		size_t max_depth{0};                                   ///< Largest queue depth since the last report
+		size_t dropped{0};                                     ///< Metrics dropped because the queue was full, since the last report
+		size_t sends{0};                                       ///< Number of send passes since the last report
+		std::chrono::steady_clock::duration send_time{0};      ///< Time spent in send passes since the last report
+	};
+
+	bool acceptingMetrics_(std::string const& name);
+
+	MetricShard& localShard_();
+
+	MetricHandle const& localHandle_(MetricShard& shard, std::string const& name, MetricType type, std::string const& unit, int level,
+	                                 MetricMode mode, std::string const& metricPrefix, bool useNameOverride);
+
+	template<typename T>
+	void sendHandleMetric_(MetricHandle const& handle, T const& value, MetricType type);
+
+	bool addPoint_(MetricShard& shard, MetricGeneration& generation, size_t id, std::string const& value);
+
+	template<typename Target, typename T>
+	bool addPoint_(MetricGeneration& generation, MetricData const& descriptor, size_t id, Target& cached, T const& value);
+
+	void dropPoint_(MetricGeneration& generation, size_t id);
+
+	void harvestMetrics_(size_t& calls, size_t& missed);
+
+	void processMetrics_(bool collect_system_metrics);
+
+	void sendToPlugins_(MetricData const& data);
+
+	void sendPluginMetrics_(size_t index, std::chrono::steady_clock::time_point interval_end);
+
+	void startPluginWorkers_();
+
+	void stopPluginWorkers_();
+
+	void pluginWorkerLoop_(size_t index);
+
+	std::chrono::steady_clock::time_point lastMetricReceived_();
+
+	void requestFlush_();
+
+	std::chrono::steady_clock::time_point nextSendTime_(std::chrono::steady_clock::time_point last_send_time);
+
 	void startMetricLoop_();
 
 	std::vector<std::unique_ptr<artdaq::MetricPlugin>> metric_plugins_;
+	std::vector<std::unique_ptr<PluginWorker>> plugin_workers_;  // Indexed like metric_plugins_
 	boost::thread metric_sending_thread_;
 	std::mutex metric_mutex_;
 	std::condition_variable metric_cv_;
+	bool flush_requested_{false};  // Protected by metric_mutex_
 	int metric_send_interval_ms_{15000};
 	int metric_holdoff_us_{1000};
-	std::chrono::steady_clock::time_point last_metric_received_;
 	std::unique_ptr<SystemMetricCollector> system_metric_collector_;
 
 	std::atomic<bool> initialized_;
 	std::atomic<bool> running_;
 	std::atomic<bool> active_;
 	std::atomic<bool> busy_;
+	std::atomic<uint64_t> level_mask_{0};  // Union of the level masks of all plugins
 	std::string prefix_;
 
-	std::unordered_map<std::string, std::unique_ptr<MetricData>> metric_cache_;
-	std::mutex metric_cache_mutex_;
-	std::atomic<size_t> missed_metric_calls_;
-	std::atomic<size_t> metric_calls_;
+	static std::atomic<size_t> next_instance_id_;
+	size_t instance_id_;
+	std::unordered_map<std::string, size_t> metric_ids_;
+	std::vector<std::unique_ptr<MetricData>> metric_registry_;  // Immutable descriptors, indexed by metric id
+	std::mutex metric_registry_mutex_;
+	std::vector<std::shared_ptr<MetricShard>> metric_shards_;
+	std::mutex metric_shards_mutex_;
+
+	// Harvest state, only used by the sending thread
+	std::vector<std::shared_ptr<MetricShard>> harvest_shards_;
+	std::vector<MetricData> harvest_totals_;  // Merged values, indexed by metric id
+	std::vector<std::string> harvest_names_;  // Prefixed output names, indexed by metric id
+	std::vector<size_t> harvest_ids_;         // Ids with values in harvest_totals_
+	std::vector<size_t> harvest_dropped_;     // Dropped values, indexed by metric id
+	MetricDataPool internal_metrics_;         // MetricManager and system metrics, refilled in each reporting cycle
+	std::string prefixed_name_;               // Buffer for prefixing the names of internal_metrics_
 	size_t metric_cache_max_size_{1000};
 	size_t metric_cache_notify_size_{10};
+	OverflowPolicy numeric_overflow_policy_{OverflowPolicy::Unbounded};
+	OverflowPolicy string_overflow_policy_{OverflowPolicy::Drop};
 
 	std::chrono::steady_clock::time_point last_failure_;
 };
 
+/**
+ * \brief Send a metric through a MetricManager, evaluating the remaining arguments only if the metric can be sent
+ * \param manager The MetricManager instance
+ * \param level The verbosity level of the metric, which must be a constant expression
+ *
+ * The remaining arguments are those of MetricManager::sendMetric<Level>: name, value, unit, mode, and optionally metricPrefix and
+ * useNameOverride. If level is above ARTDAQ_METRIC_MAX_LEVEL, the statement compiles to nothing. Otherwise, the arguments are only
+ * evaluated if a MetricPlugin accepts the level (see MetricManager::IsLevelEnabled).
+ */
+#define ARTDAQ_SEND_METRIC(manager, level, ...)                            \
+	do                                                                     \
+	{                                                                      \
+		if constexpr ((level) <= ARTDAQ_METRIC_MAX_LEVEL)                  \
+		{                                                                  \
+			if ((manager).IsLevelEnabled(level))                           \
+			{                                                              \
+				(manager).sendMetric<(level)>(__VA_ARGS__);                \
+			}                                                              \
+		}                                                                  \
+	} while (0)
+
 #endif /* artdaq_DAQrate_MetricManager_hh */
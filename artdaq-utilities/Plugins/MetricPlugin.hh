@@ -18,10 +18,20 @@
 #define METLOG(lvl) TLOG(lvl) << metric_name_ << ": "
 #define METLOG_P(lvl) TLOG(lvl, "MetricPlugin") << metric_name_ << ": "
 
+#include <algorithm>
+#include <array>
 #include <bitset>
 #include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include "fhiclcpp/ParameterSet.h"
 #include "fhiclcpp/types/Atom.h"
 #include "fhiclcpp/types/ConfigurationTable.h"
@@ -41,6 +51,18 @@ namespace artdaq {
 class MetricPlugin
 {
 public:
+	/**
+	 * \brief One reported value, as passed to sendMetrics_
+	 */
+	struct MetricRecord
+	{
+		size_t name_id;                                    ///< Name of the metric (including mode suffix), see recordString
+		MetricData::MetricDataValue value;                 ///< Value of the metric
+		size_t unit_id;                                    ///< Units of the metric, see recordString
+		MetricType type;                                   ///< Type of the metric, selects the member of value
+		std::chrono::system_clock::time_point timestamp;  ///< End point of the aggregation interval
+	};
+
 	/**
 	 * \brief The Config struct defines the accepted configuration parameters for this class
 	 */
@@ -58,6 +80,14 @@ public:
 		fhicl::Atom<double> reporting_interval{fhicl::Name{"reporting_interval"}, fhicl::Comment{"How often recorded metrics are sent to the underlying metric storage"}, 15.0};
 		/// "send_zeros" (Default: true): Whether zeros should be sent to the metric back-end when metrics are not reported in an interval and during shutdown
 		fhicl::Atom<bool> send_zeros{fhicl::Name{"send_zeros"}, fhicl::Comment{"Whether zeros should be sent to the metric back-end when metrics are not reported in an interval and during shutdown"}, true};
+		/// "percentiles" (Default: [50, 90, 99, 99.9]): The percentiles reported for metrics in MetricMode::Histogram or MetricMode::Quantiles
+		fhicl::Sequence<double> percentiles{fhicl::Name{"percentiles"}, fhicl::Comment{"The percentiles reported for metrics in MetricMode::Histogram or MetricMode::Quantiles"}, std::vector<double>{50, 90, 99, 99.9}};
+		/// "report_sketches" (Default: false): Whether metrics in MetricMode::Quantiles also report their QuantileSketch each interval, as a string metric named "<name> - Sketch" (see QuantileSketch::SerializeText). Only meaningful for back-ends which store string values
+		fhicl::Atom<bool> report_sketches{fhicl::Name{"report_sketches"}, fhicl::Comment{"Whether metrics in MetricMode::Quantiles also report their QuantileSketch each interval, as a string metric named \"<name> - Sketch\", so that sketches from many processes can be combined. Only meaningful for back-ends which store string values"}, false};
+		/// "use_worker_thread" (Default: false): Whether MetricManager drives this plugin from its own thread, so that a slow back-end does not delay other plugins
+		fhicl::Atom<bool> use_worker_thread{fhicl::Name{"use_worker_thread"}, fhicl::Comment{"Whether MetricManager drives this plugin from its own thread, so that a slow back-end does not delay other plugins"}, false};
+		/// "worker_queue_size" (Default: 1000): The maximum number of metrics waiting for the worker thread. Further metrics are dropped until it catches up
+		fhicl::Atom<size_t> worker_queue_size{fhicl::Name{"worker_queue_size"}, fhicl::Comment{"The maximum number of metrics waiting for the worker thread. Further metrics are dropped until it catches up"}, 1000};
 	};
 	/// Used for ParameterSet validation (if desired)
 	using Parameters = fhicl::WrappedTable<Config>;
@@ -78,6 +108,7 @@ public:
 	    , inhibit_(false)
 	    , level_mask_(0ULL)
 	    , sendZeros_(pset.get<bool>("send_zeros", true))
+	    , reportSketches_(pset.get<bool>("report_sketches", false))
 	{
 		METLOG_P(TLVL_TRACE) << "MetricPlugin ctor start";
 		if (pset.has_key("level"))
@@ -134,6 +165,13 @@ public:
 			    << "No levels were enabled for this plugin! Please specify at least one of the following Parameters: \"level\", \"metric_levels\", or \"level_string\"!";
 		}
 		accumulationTime_ = pset.get<double>("reporting_interval", 15.0);
+
+		for (auto percentile : pset.get<std::vector<double>>("percentiles", std::vector<double>{50, 90, 99, 99.9}))
+		{
+			std::ostringstream suffix;
+			suffix << " - p" << percentile;
+			percentiles_.emplace_back(percentile, suffix.str());
+		}
 	}
 
 	/**
@@ -208,6 +246,29 @@ protected:
 	 */
 	virtual void sendMetric_(const std::string& name, const uint64_t& value, const std::string& unit, const std::chrono::system_clock::time_point& interval_end) = 0;
 
+	/**
+	 * \brief Send the values reported in one sendMetrics or stopMetrics call to the underlying metric storage
+	 * \param records The reported values
+	 * \param count The number of reported values
+	 *
+	 * Plugins which can write many values at once (network and file plugins) should override this. The default
+	 * implementation calls the sendMetric_ overload matching each record's type.
+	 */
+	virtual void sendMetrics_(MetricRecord const* records, size_t count)
+	{
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			sendMetric_(recordString(records[ii].name_id), records[ii].value, recordString(records[ii].unit_id), records[ii].type, records[ii].timestamp);
+		}
+	}
+
+	/**
+	 * \brief Look up a name or unit string of a MetricRecord
+	 * \param id The name_id or unit_id of the record
+	 * \return The name or units
+	 */
+	std::string const& recordString(size_t id) const { return recordStrings_[id]; }
+
 	/**
 	 * \brief Perform any start-up actions necessary for the metric plugin
 	 *
@@ -232,22 +293,30 @@ public:
 	 * \brief Send a metric value to the MetricPlugin
 	 * \param data A MetricData struct containing the metric value
 	 */
-	void addMetricData(std::unique_ptr<MetricData> const& data)
+	void addMetricData(std::unique_ptr<MetricData> const& data) { addMetricData(*data); }
+
+	/**
+	 * \brief Send a metric value to the MetricPlugin
+	 * \param data A MetricData struct containing the metric value
+	 */
+	void addMetricData(MetricData const& data)
 	{
-		METLOG_P(TLVL_DEBUG + 42) << "Adding metric data for name " << data->Name;
-		if (data->Type == MetricType::StringMetric)
+		METLOG_P(TLVL_DEBUG + 42) << "Adding metric data for name " << data.Name;
+		if (data.Type == MetricType::StringMetric)
 		{
-			sendMetric_(data->Name, data->StringValue, data->Unit, std::chrono::system_clock::now());
+			sendMetric_(data.Name, data.StringValue, data.Unit, std::chrono::system_clock::now());
 		}
 		else
 		{
-			if (metricRegistry_.count(data->Name) == 0)
+			auto& slot = findSlot_(data);
+			if (slot.persisted)
 			{
-				metricRegistry_[data->Name] = *data;
+				// New values replace the persisted ones
+				slot.data.Reset();
+				slot.persisted = false;
 			}
-			metricData_[data->Name].push_back(*data);
-			METLOG_P(TLVL_DEBUG + 42) << "Current list size: " << metricData_[data->Name].size();
-			// sendMetrics();
+			slot.data.Add(data);
+			METLOG_P(TLVL_DEBUG + 42) << "Current point count: " << slot.data.DataPointCount;
 		}
 	}
 
@@ -262,47 +331,320 @@ public:
 	void sendMetrics(bool forceSend = false,
 	                 std::chrono::steady_clock::time_point interval_end = std::chrono::steady_clock::now())
 	{
-		METLOG_P(TLVL_DEBUG + 43) << "sendMetrics called" << std::endl;
-		for (auto& metric : metricData_)
+		MetricPlugin* self = this;
+		sendMetrics(&self, 1, forceSend, interval_end);
+	}
+
+	/**
+	 * \brief Send metrics for plugins sharing one aggregate (see shareAggregate). The reporting interval is checked
+	 * once, each plugin reports the values at its enabled levels, and the aggregate is then cleared.
+	 * \param plugins The plugins sharing the aggregate
+	 * \param count The number of plugins
+	 * \param forceSend Force sending metrics, even if reporting interval has not elapsed
+	 * \param interval_end For calculating rates, when the current reporting interval ended
+	 */
+	static void sendMetrics(MetricPlugin* const* plugins, size_t count, bool forceSend, std::chrono::steady_clock::time_point interval_end)
+	{
+		auto& aggregate = *plugins[0]->aggregate_;
+		plugins[0]->collectReady_(forceSend);
+		for (auto index : aggregate.ready)
 		{
-			if (readyToSend_(metric.first) || forceSend)
+			auto& slot = aggregate.slots[index];
+			if ((slot.data.Mode & MetricMode::SmoothedRate) != MetricMode::None)
 			{
-				METLOG_P(TLVL_DEBUG + 44) << "Sending metric " << metric.first;
-				if (metric.second.empty() && metricRegistry_.count(metric.first))
+				updateSmoothedRates_(slot, interval_end);
+			}
+		}
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			plugins[ii]->reportMetrics_(interval_end);
+		}
+		for (auto index : aggregate.ready)
+		{
+			auto& slot = aggregate.slots[index];
+			if (slot.data.DataPointCount > 0)
+			{
+				if ((slot.data.Mode & MetricMode::Persist) == MetricMode::None)
 				{
-					METLOG_P(TLVL_DEBUG + 44) << "Sending zero";
-					sendZero_(metricRegistry_[metric.first]);
+					slot.data.Reset();
 				}
-				else if (!metric.second.empty())
+				else
 				{
-					METLOG_P(TLVL_DEBUG + 44) << "Aggregating " << metric.second.size() << " MetricData points";
+					TLOG(TLVL_DEBUG + 44) << "Metric " << slot.data.Name << " is Persisted, keeping its values until new ones arrive";
+					slot.persisted = true;
+				}
+			}
+			slot.interval_start = interval_end;
+		}
+		aggregate.ready.clear();
+	}
 
-					if ((metric.second.front().Mode & MetricMode::Persist) != MetricMode::None && metric.second.size() > 1)
-					{
-						TLOG(TLVL_DEBUG + 44) << "Metric is in Persist mode and multiple instances are present. Removing the first entry.";
-						metric.second.erase(metric.second.begin());
-					}
+	/**
+	 * \brief Have this plugin use the aggregate of another plugin with the same reporting interval, so that values are
+	 * only aggregated once. Metrics must then be sent to the other plugin only, and the plugins sent and stopped together
+	 * with the static sendMetrics and stopMetrics.
+	 * \param other Plugin whose aggregate will be used
+	 */
+	void shareAggregate(MetricPlugin& other)
+	{
+		aggregate_ = other.aggregate_;
+		sharedAggregate_ = true;
+		other.sharedAggregate_ = true;
+	}
+
+	/**
+	 * \brief Get the reporting interval of this MetricPlugin
+	 * \return The reporting interval, in seconds
+	 */
+	double GetReportingInterval() const { return accumulationTime_; }
 
-					MetricData& data = metric.second.front();
+	/**
+	 * \brief Perform startup actions. Simply calls the virtual startMetrics_ function
+	 */
+	void startMetrics() { startMetrics_(); }
 
-					auto it = ++(metric.second.begin());
-					while (it != metric.second.end())
-					{
-						data.Add(*it);
-						it = metric.second.erase(it);
-					}
+	/**
+	 * \brief Perform shutdown actions. Zeroes out all accumulators, and sends zeros for each metric.
+	 * Calls stopMetrics_() for any plugin-defined shutdown actions.
+	 */
+	void stopMetrics()
+	{
+		MetricPlugin* self = this;
+		stopMetrics(&self, 1);
+	}
+
+	/**
+	 * \brief Perform shutdown actions for plugins sharing one aggregate (see shareAggregate)
+	 * \param plugins The plugins sharing the aggregate
+	 * \param count The number of plugins
+	 */
+	static void stopMetrics(MetricPlugin* const* plugins, size_t count)
+	{
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			plugins[ii]->inhibit_ = true;
+		}
+		sendMetrics(plugins, count, true, std::chrono::steady_clock::now());
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			auto plugin = plugins[ii];
+			for (auto const& slot : plugin->aggregate_->slots)
+			{
+				if (!plugin->sharedAggregate_ || plugin->IsLevelEnabled(slot.data.Level))
+				{
+					plugin->sendZero_(&slot - plugin->aggregate_->slots.data(), true);
+				}
+			}
+			plugin->flushRecords_();
+			plugin->stopMetrics_();
+			plugin->inhibit_ = false;
+		}
+	}
+
+	/**
+	 * \brief Determine if the given level is enabled for this MetricPlugin instance
+	 * \param level Level to check
+	 * \return True if level is enabled, false otherwise
+	 */
+	bool IsLevelEnabled(int level)
+	{
+		if (level > 63) level = 63;
+		if (level < 0) return true;
+		return level_mask_[level];
+	}
+
+	/**
+	 * \brief Get the levels which are enabled for this MetricPlugin instance
+	 * \return Bitset with the bit for each enabled level set
+	 */
+	std::bitset<64> const& GetLevelMask() const { return level_mask_; }
+
+	/**
+	 * \brief Determine if metrics are waiting to be sent.
+	 * \return True if metrics have been queued for sending by this MetricPlugin instance
+	 */
+	bool metricsPending()
+	{
+		for (auto& slot : aggregate_->slots)
+		{
+			if (slot.data.DataPointCount > 0)
+			{
+				METLOG_P(TLVL_DEBUG + 33) << "Metric " << slot.data.Name << " has " << slot.data.DataPointCount << " pending points" << std::endl;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * \brief Determine when sendMetrics will next report a metric
+	 * \return The earliest time at which the reporting interval of a known metric elapses, or one reporting interval from now if
+	 * no metrics are known
+	 */
+	std::chrono::steady_clock::time_point nextSendTime()
+	{
+		auto interval = std::chrono::ceil<std::chrono::steady_clock::duration>(std::chrono::duration<double>(accumulationTime_));
+		if (aggregate_->slots.empty())
+		{
+			return std::chrono::steady_clock::now() + interval;
+		}
+
+		// The schedule is ordered by deadline
+		auto& first = aggregate_->slots[aggregate_->schedule.front()];
+		if (first.last_send == std::chrono::steady_clock::time_point())
+		{
+			return std::chrono::steady_clock::time_point();
+		}
+		return first.last_send + interval;
+	}
+
+protected:
+	fhicl::ParameterSet pset;     ///< The ParameterSet used to configure the MetricPlugin
+	double accumulationTime_;     ///< The amount of time to average metric values; except for accumulate=false metrics, will be the interval at which each metric is sent.
+	std::string app_name_;        ///< Name of the application which is sending metrics to this plugin
+	std::string metric_name_;     ///< Name of this MetricPlugin instance
+	bool inhibit_;                ///< Flag to indicate that the MetricPlugin is being stopped, and any metric back-ends which do not have a persistent state (i.e. file) should not report further metrics
+	std::bitset<64> level_mask_;  ///< Bitset indicating for each possible metric level, whether this plugin will receive those metrics
+	bool sendZeros_;              ///< Whether zeros should be sent to this metric backend when metric instances are missing or at the end of the run
+	bool reportSketches_;         ///< Whether metrics in MetricMode::Quantiles also report their serialized QuantileSketch
+
+private:
+	MetricPlugin(const MetricPlugin&) = delete;
+	MetricPlugin(MetricPlugin&&) = delete;
+	MetricPlugin& operator=(const MetricPlugin&) = delete;
+	MetricPlugin& operator=(MetricPlugin&&) = delete;
+
+	/// Running aggregate of one metric, updated in place by addMetricData
+	struct MetricSlot
+	{
+		MetricData data;                                        // Values received since the last report, or the last reported values if persisted
+		size_t hash{0};                                         // Hash of data.Name
+		bool persisted{false};                                  // Whether data holds the reported values of a MetricMode::Persist metric
+		std::chrono::steady_clock::time_point last_send;        // When the metric was last reported
+		std::chrono::steady_clock::time_point interval_start;  // Start of the current interval, for MetricMode::Rate
+		std::array<double, 3> smoothed_rates{};                // Moving averages over SmoothedRateWindows, for MetricMode::SmoothedRate
+		bool smoothed{false};                                   // Whether smoothed_rates holds a measured rate yet
+	};
+	static constexpr std::array<double, 3> SmoothedRateWindows{{60.0, 300.0, 900.0}};  // Seconds
+	static constexpr size_t NoSlot = std::numeric_limits<size_t>::max();
+
+	/// Running aggregates of all metrics, possibly shared with other plugins (see shareAggregate)
+	struct MetricAggregate
+	{
+		std::vector<MetricSlot> slots;  // In order of first appearance
+		std::vector<size_t> table;      // Open-addressing (linear probing) index into slots by name hash; size is zero or a power of two
+		std::deque<size_t> schedule;    // Indices of all slots, in order of their next deadline (last_send + reporting interval)
+		std::vector<size_t> ready;      // Indices of the slots reported in the current send pass
+	};
+
+	std::shared_ptr<MetricAggregate> aggregate_{std::make_shared<MetricAggregate>()};
+	bool sharedAggregate_{false};
+
+	/// Output names and units of one metric, as ids for recordString. Built when the metric is first reported.
+	struct MetricNames
+	{
+		bool built{false};
+		size_t unit{0};
+		size_t rate_unit{0};
+		size_t variance_unit{0};
+		size_t last{0};
+		size_t total{0};
+		size_t average{0};
+		size_t rate{0};
+		size_t min{0};
+		size_t max{0};
+		size_t stddev{0};
+		size_t variance{0};
+		size_t sketch{0};
+		std::array<size_t, 3> smoothed_rates{};  // One per entry of SmoothedRateWindows
+		std::vector<size_t> percentiles;  // One per entry of percentiles_
+	};
+	std::vector<MetricNames> slotNames_;  // Indexed like aggregate_->slots. Ids are specific to this plugin, even if the aggregate is shared.
+	std::vector<MetricRecord> records_;  // Values waiting for the next sendMetrics_ call
+	/// A serialized QuantileSketch waiting to be sent, after the records it was reported with
+	struct SketchRecord
+	{
+		size_t name_id;
+		std::string text;
+		size_t unit_id;
+		std::chrono::system_clock::time_point timestamp;
+	};
+	std::vector<SketchRecord> sketches_;
+	std::vector<std::string> recordStrings_;
+	std::unordered_map<std::string, size_t> recordStringIds_;
+	std::vector<std::pair<double, std::string>> percentiles_;  // Percentile and name suffix, for MetricMode::Histogram and MetricMode::Quantiles
+
+	std::chrono::system_clock::time_point to_system_clock(std::chrono::steady_clock::time_point const& t)
+	{
+		auto pt = std::chrono::system_clock::now() + (t - std::chrono::steady_clock::now());
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(pt.time_since_epoch()));
+	}
+
+	void collectReady_(bool forceSend)
+	{
+		auto& aggregate = *aggregate_;
+		auto now = std::chrono::steady_clock::now();
+		if (forceSend)
+		{
+			// Every metric is reported, and they all get the same deadline
+			aggregate.schedule.clear();
+			for (size_t ii = 0; ii < aggregate.slots.size(); ++ii)
+			{
+				aggregate.slots[ii].last_send = now;
+				aggregate.schedule.push_back(ii);
+				aggregate.ready.push_back(ii);
+			}
+			return;
+		}
+
+		// All metrics have the same reporting interval, so a metric reported now goes to the back of the schedule. Only
+		// visit the metrics which were already scheduled, in case the reporting interval is zero.
+		for (auto remaining = aggregate.schedule.size(); remaining > 0; --remaining)
+		{
+			auto index = aggregate.schedule.front();
+			auto& slot = aggregate.slots[index];
+			if (std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1>>>(now - slot.last_send).count() < accumulationTime_)
+			{
+				break;
+			}
+			slot.last_send = now;
+			aggregate.schedule.pop_front();
+			aggregate.schedule.push_back(index);
+			aggregate.ready.push_back(index);
+		}
+	}
+
+	void reportMetrics_(std::chrono::steady_clock::time_point interval_end)
+	{
+		METLOG_P(TLVL_DEBUG + 43) << "sendMetrics called" << std::endl;
+		for (auto index : aggregate_->ready)
+		{
+			auto& slot = aggregate_->slots[index];
+			// A shared aggregate holds the metrics enabled for any of the plugins sharing it
+			if (!sharedAggregate_ || IsLevelEnabled(slot.data.Level))
+			{
+				METLOG_P(TLVL_DEBUG + 44) << "Sending metric " << slot.data.Name;
+				if (slot.data.DataPointCount == 0)
+				{
+					METLOG_P(TLVL_DEBUG + 44) << "Sending zero";
+					sendZero_(index, false);
+				}
+				else
+				{
+					METLOG_P(TLVL_DEBUG + 44) << "Reporting " << slot.data.DataPointCount << " points";
+					MetricData const& data = slot.data;
+					auto const& names = recordNames_(index);
 
-					std::bitset<32> modeSet(static_cast<uint32_t>(data.Mode));
-					bool useSuffix = true;
-					if (modeSet.count() <= 1 || (modeSet.count() <= 2 && (data.Mode & MetricMode::Persist) != MetricMode::None)) useSuffix = false;
+					auto timestamp = to_system_clock(slot.last_send);
 
 					if ((data.Mode & MetricMode::LastPoint) != MetricMode::None)
 					{
-						sendMetric_(data.Name + (useSuffix ? " - Last" : ""), data.Last, data.Unit, data.Type, to_system_clock(lastSendTime_[data.Name]));
+						queueRecord_(names.last, data.Last, names.unit, data.Type, timestamp);
 					}
 					if ((data.Mode & MetricMode::Accumulate) != MetricMode::None)
 					{
-						sendMetric_(data.Name + (useSuffix ? " - Total" : ""), data.Value, data.Unit, data.Type, to_system_clock(lastSendTime_[data.Name]));
+						queueRecord_(names.total, data.Value, names.unit, data.Type, timestamp);
 					}
 					if ((data.Mode & MetricMode::Average) != MetricMode::None)
 					{
@@ -324,12 +666,12 @@ public:
 							default:
 								break;
 						}
-						sendMetric_(data.Name + (useSuffix ? " - Average" : ""), average, data.Unit, to_system_clock(lastSendTime_[data.Name]));
+						queueRecord_(names.average, average, names.unit, MetricType::DoubleMetric, timestamp);
 					}
 					if ((data.Mode & MetricMode::Rate) != MetricMode::None)
 					{
 						double duration = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1>>>(
-						                      interval_end - interval_start_[metric.first])
+						                      interval_end - slot.interval_start)
 						                      .count();
 						double rate = 0.0;
 						switch (data.Type)
@@ -349,131 +691,110 @@ public:
 							default:
 								break;
 						}
-						sendMetric_(data.Name + (useSuffix ? " - Rate" : ""), rate, data.Unit + "/s", to_system_clock(lastSendTime_[data.Name]));
+						queueRecord_(names.rate, rate, names.rate_unit, MetricType::DoubleMetric, timestamp);
 					}
 					if ((data.Mode & MetricMode::Minimum) != MetricMode::None)
 					{
-						sendMetric_(data.Name + (useSuffix ? " - Min" : ""), data.Min, data.Unit, data.Type, to_system_clock(lastSendTime_[data.Name]));
+						queueRecord_(names.min, data.Min, names.unit, data.Type, timestamp);
 					}
 					if ((data.Mode & MetricMode::Maximum) != MetricMode::None)
 					{
-						sendMetric_(data.Name + (useSuffix ? " - Max" : ""), data.Max, data.Unit, data.Type, to_system_clock(lastSendTime_[data.Name]));
+						queueRecord_(names.max, data.Max, names.unit, data.Type, timestamp);
 					}
-
-					if ((data.Mode & MetricMode::Persist) == MetricMode::None)
+					if ((data.Mode & MetricMode::StdDev) != MetricMode::None)
 					{
-						METLOG_P(TLVL_DEBUG + 44) << "Clearing metric data list sz=" << metric.second.size();
-						metric.second.clear();
-						METLOG_P(TLVL_DEBUG + 44) << "Cleared metric data list sz=" << metricData_[metric.first].size();
+						queueRecord_(names.stddev, data.StdDev(), names.unit, MetricType::DoubleMetric, timestamp);
 					}
-					else
+					if ((data.Mode & MetricMode::Variance) != MetricMode::None)
 					{
-						TLOG(TLVL_DEBUG + 44) << "Metric is Persisted, leaving " << metricData_[metric.first].size() << " entries (should be 1)";
+						queueRecord_(names.variance, data.Variance(), names.variance_unit, MetricType::DoubleMetric, timestamp);
+					}
+					if ((data.Mode & (MetricMode::Histogram | MetricMode::Quantiles)) != MetricMode::None)
+					{
+						bool useSketch = (data.Mode & MetricMode::Quantiles) != MetricMode::None;
+						for (size_t ii = 0; ii < percentiles_.size(); ++ii)
+						{
+							auto percentile = percentiles_[ii].first;
+							queueRecord_(names.percentiles[ii],
+							             useSketch ? data.SketchPercentile(percentile) : data.HistogramPercentile(percentile),
+							             names.unit, MetricType::DoubleMetric, timestamp);
+						}
+						if (useSketch && reportSketches_)
+						{
+							sketches_.push_back(SketchRecord{names.sketch, data.Sketch.SerializeText(), names.unit, timestamp});
+						}
+					}
+				}
+
+				// Smoothed rates decay through intervals without values, so they are reported rather than zeroed
+				if ((slot.data.Mode & MetricMode::SmoothedRate) != MetricMode::None)
+				{
+					auto const& names = recordNames_(index);
+					auto timestamp = to_system_clock(slot.last_send);
+					for (size_t ii = 0; ii < SmoothedRateWindows.size(); ++ii)
+					{
+						queueRecord_(names.smoothed_rates[ii], slot.smoothed_rates[ii], names.rate_unit, MetricType::DoubleMetric, timestamp);
 					}
 				}
-				interval_start_[metric.first] = interval_end;
 			}
 		}
+		flushRecords_();
 		METLOG_P(TLVL_DEBUG + 43) << "sendMetrics done" << std::endl;
 	}
 
-	/**
-	 * \brief Perform startup actions. Simply calls the virtual startMetrics_ function
-	 */
-	void startMetrics() { startMetrics_(); }
-
-	/**
-	 * \brief Perform shutdown actions. Zeroes out all accumulators, and sends zeros for each metric.
-	 * Calls stopMetrics_() for any plugin-defined shutdown actions.
-	 */
-	void stopMetrics()
+	MetricSlot& findSlot_(MetricData const& data)
 	{
-		inhibit_ = true;
-		sendMetrics(true);
-		for (auto const& metric : metricRegistry_)
+		auto hash = std::hash<std::string>()(data.Name);
+		auto mask = aggregate_->table.size() - 1;
+		if (!aggregate_->table.empty())
 		{
-			sendZero_(metric.second);
+			for (auto pos = hash & mask; aggregate_->table[pos] != NoSlot; pos = (pos + 1) & mask)
+			{
+				auto& slot = aggregate_->slots[aggregate_->table[pos]];
+				if (slot.hash == hash && slot.data.Name == data.Name)
+				{
+					return slot;
+				}
+			}
 		}
-		stopMetrics_();
-		inhibit_ = false;
-	}
-
-	/**
-	 * \brief Determine if the given level is enabled for this MetricPlugin instance
-	 * \param level Level to check
-	 * \return True if level is enabled, false otherwise
-	 */
-	bool IsLevelEnabled(int level)
-	{
-		if (level > 63) level = 63;
-		if (level < 0) return true;
-		return level_mask_[level];
-	}
 
-	/**
-	 * \brief Determine if metrics are waiting to be sent.
-	 * \return True if metrics have been queued for sending by this MetricPlugin instance
-	 */
-	bool metricsPending()
-	{
-		for (auto& metric : metricData_)
+		// First value of this metric: it becomes the template of the running aggregate
+		if ((aggregate_->slots.size() + 1) * 2 > aggregate_->table.size())
 		{
-			if (!metric.second.empty())
+			aggregate_->table.assign(std::max(size_t(16), aggregate_->table.size() * 2), NoSlot);
+			for (size_t ii = 0; ii < aggregate_->slots.size(); ++ii)
 			{
-				METLOG_P(TLVL_DEBUG + 33) << "Metric " << metric.first << " has " << metric.second.size() << " pending MetricData instances" << std::endl;
-				return true;
+				insertSlot_(aggregate_->slots[ii].hash, ii);
 			}
 		}
-
-		return false;
+		aggregate_->slots.emplace_back();
+		aggregate_->slots.back().data = data;
+		aggregate_->slots.back().data.Reset();
+		aggregate_->slots.back().hash = hash;
+		insertSlot_(hash, aggregate_->slots.size() - 1);
+		// Never reported, so it is due now
+		aggregate_->schedule.push_front(aggregate_->slots.size() - 1);
+		return aggregate_->slots.back();
 	}
 
-protected:
-	fhicl::ParameterSet pset;     ///< The ParameterSet used to configure the MetricPlugin
-	double accumulationTime_;     ///< The amount of time to average metric values; except for accumulate=false metrics, will be the interval at which each metric is sent.
-	std::string app_name_;        ///< Name of the application which is sending metrics to this plugin
-	std::string metric_name_;     ///< Name of this MetricPlugin instance
-	bool inhibit_;                ///< Flag to indicate that the MetricPlugin is being stopped, and any metric back-ends which do not have a persistent state (i.e. file) should not report further metrics
-	std::bitset<64> level_mask_;  ///< Bitset indicating for each possible metric level, whether this plugin will receive those metrics
-	bool sendZeros_;              ///< Whether zeros should be sent to this metric backend when metric instances are missing or at the end of the run
-
-private:
-	MetricPlugin(const MetricPlugin&) = delete;
-	MetricPlugin(MetricPlugin&&) = delete;
-	MetricPlugin& operator=(const MetricPlugin&) = delete;
-	MetricPlugin& operator=(MetricPlugin&&) = delete;
-
-	std::unordered_map<std::string, std::list<MetricData>> metricData_;
-	std::unordered_map<std::string, MetricData> metricRegistry_;
-	std::unordered_map<std::string, std::chrono::steady_clock::time_point> lastSendTime_;
-	std::unordered_map<std::string, std::chrono::steady_clock::time_point> interval_start_;
-
-	std::chrono::system_clock::time_point to_system_clock(std::chrono::steady_clock::time_point const& t)
-	{
-		auto pt = std::chrono::system_clock::now() + (t - std::chrono::steady_clock::now());
-		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(pt.time_since_epoch()));
-	}
-
-	bool readyToSend_(std::string const& name)
+	void insertSlot_(size_t hash, size_t index)
 	{
-		auto now = std::chrono::steady_clock::now();
-		if (std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1>>>(now - lastSendTime_[name]).count() >= accumulationTime_)
+		auto mask = aggregate_->table.size() - 1;
+		auto pos = hash & mask;
+		while (aggregate_->table[pos] != NoSlot)
 		{
-			lastSendTime_[name] = now;
-			return true;
+			pos = (pos + 1) & mask;
 		}
-
-		return false;
+		aggregate_->table[pos] = index;
 	}
 
-	void sendZero_(MetricData data)
+	void sendZero_(size_t index, bool endOfRun)
 	{
 		if (sendZeros_)
 		{
-			std::bitset<32> modeSet(static_cast<uint32_t>(data.Mode));
-			bool useSuffix = true;
-			if (modeSet.count() <= 1) useSuffix = false;
-
+			auto const& data = aggregate_->slots[index].data;
+			auto const& names = recordNames_(index);
+			auto now = std::chrono::system_clock::now();
 			MetricData::MetricDataValue zero;
 			switch (data.Type)
 			{
@@ -495,29 +816,167 @@ private:
 
 			if ((data.Mode & MetricMode::LastPoint) != MetricMode::None)
 			{
-				sendMetric_(data.Name + (useSuffix ? " - Last" : ""), zero, data.Unit, data.Type, std::chrono::system_clock::now());
+				queueRecord_(names.last, zero, names.unit, data.Type, now);
 			}
 			if ((data.Mode & MetricMode::Accumulate) != MetricMode::None)
 			{
-				sendMetric_(data.Name + (useSuffix ? " - Total" : ""), zero, data.Unit, data.Type, std::chrono::system_clock::now());
+				queueRecord_(names.total, zero, names.unit, data.Type, now);
 			}
 			if ((data.Mode & MetricMode::Average) != MetricMode::None)
 			{
-				sendMetric_(data.Name + (useSuffix ? " - Average" : ""), 0.0, data.Unit, std::chrono::system_clock::now());
+				queueRecord_(names.average, 0.0, names.unit, MetricType::DoubleMetric, now);
 			}
 			if ((data.Mode & MetricMode::Rate) != MetricMode::None)
 			{
-				sendMetric_(data.Name + (useSuffix ? " - Rate" : ""), 0.0, data.Unit + "/s", std::chrono::system_clock::now());
+				queueRecord_(names.rate, 0.0, names.rate_unit, MetricType::DoubleMetric, now);
 			}
 			if ((data.Mode & MetricMode::Minimum) != MetricMode::None)
 			{
-				sendMetric_(data.Name + (useSuffix ? " - Min" : ""), zero, data.Unit, data.Type, std::chrono::system_clock::now());
+				queueRecord_(names.min, zero, names.unit, data.Type, now);
 			}
 			if ((data.Mode & MetricMode::Maximum) != MetricMode::None)
 			{
-				sendMetric_(data.Name + (useSuffix ? " - Max" : ""), zero, data.Unit, data.Type, std::chrono::system_clock::now());
+				queueRecord_(names.max, zero, names.unit, data.Type, now);
 			}
+			if ((data.Mode & MetricMode::StdDev) != MetricMode::None)
+			{
+				queueRecord_(names.stddev, 0.0, names.unit, MetricType::DoubleMetric, now);
+			}
+			if ((data.Mode & MetricMode::Variance) != MetricMode::None)
+			{
+				queueRecord_(names.variance, 0.0, names.variance_unit, MetricType::DoubleMetric, now);
+			}
+			if (endOfRun && (data.Mode & MetricMode::SmoothedRate) != MetricMode::None)
+			{
+				for (auto name : names.smoothed_rates)
+				{
+					queueRecord_(name, 0.0, names.rate_unit, MetricType::DoubleMetric, now);
+				}
+			}
+			for (auto name : names.percentiles)
+			{
+				queueRecord_(name, 0.0, names.unit, MetricType::DoubleMetric, now);
+			}
+		}
+	}
+
+	MetricNames const& recordNames_(size_t index)
+	{
+		if (slotNames_.size() <= index)
+		{
+			slotNames_.resize(aggregate_->slots.size());
+		}
+		auto& names = slotNames_[index];
+		if (names.built)
+		{
+			return names;
+		}
+
+		auto const& data = aggregate_->slots[index].data;
+		std::bitset<32> modeSet(static_cast<uint32_t>(data.Mode));
+		bool useSuffix = true;
+		if (modeSet.count() <= 1 || (modeSet.count() <= 2 && (data.Mode & MetricMode::Persist) != MetricMode::None)) useSuffix = false;
+
+		names.unit = recordStringId_(data.Unit);
+		if ((data.Mode & MetricMode::LastPoint) != MetricMode::None) names.last = recordStringId_(data.Name + (useSuffix ? " - Last" : ""));
+		if ((data.Mode & MetricMode::Accumulate) != MetricMode::None) names.total = recordStringId_(data.Name + (useSuffix ? " - Total" : ""));
+		if ((data.Mode & MetricMode::Average) != MetricMode::None) names.average = recordStringId_(data.Name + (useSuffix ? " - Average" : ""));
+		if ((data.Mode & MetricMode::Rate) != MetricMode::None) names.rate = recordStringId_(data.Name + (useSuffix ? " - Rate" : ""));
+		if ((data.Mode & (MetricMode::Rate | MetricMode::SmoothedRate)) != MetricMode::None) names.rate_unit = recordStringId_(data.Unit + "/s");
+		if ((data.Mode & MetricMode::SmoothedRate) != MetricMode::None)
+		{
+			for (size_t ii = 0; ii < SmoothedRateWindows.size(); ++ii)
+			{
+				names.smoothed_rates[ii] = recordStringId_(data.Name + " - Rate " + std::to_string(static_cast<int>(SmoothedRateWindows[ii] / 60)) + "m");
+			}
+		}
+		if ((data.Mode & MetricMode::Minimum) != MetricMode::None) names.min = recordStringId_(data.Name + (useSuffix ? " - Min" : ""));
+		if ((data.Mode & MetricMode::Maximum) != MetricMode::None) names.max = recordStringId_(data.Name + (useSuffix ? " - Max" : ""));
+		if ((data.Mode & MetricMode::StdDev) != MetricMode::None) names.stddev = recordStringId_(data.Name + (useSuffix ? " - StdDev" : ""));
+		if ((data.Mode & MetricMode::Variance) != MetricMode::None)
+		{
+			names.variance = recordStringId_(data.Name + (useSuffix ? " - Variance" : ""));
+			names.variance_unit = recordStringId_(data.Unit + "^2");
+		}
+		if ((data.Mode & (MetricMode::Histogram | MetricMode::Quantiles)) != MetricMode::None)
+		{
+			for (auto const& percentile : percentiles_)
+			{
+				names.percentiles.push_back(recordStringId_(data.Name + percentile.second));
+			}
+		}
+		if ((data.Mode & MetricMode::Quantiles) != MetricMode::None && reportSketches_) names.sketch = recordStringId_(data.Name + " - Sketch");
+		names.built = true;
+		return names;
+	}
+
+	// Fold the rate of the interval ending now into each moving average. The weight of an interval grows with its length,
+	// so the averages do not depend on the reporting interval.
+	static void updateSmoothedRates_(MetricSlot& slot, std::chrono::steady_clock::time_point interval_end)
+	{
+		// The first interval of a metric has no known start
+		if (slot.interval_start == std::chrono::steady_clock::time_point()) return;
+		double duration = std::chrono::duration_cast<std::chrono::duration<double, std::ratio<1>>>(interval_end - slot.interval_start).count();
+		if (duration <= 0) return;
+
+		double rate = 0.0;
+		switch (slot.data.Type)
+		{
+			case MetricType::DoubleMetric:
+				rate = slot.data.Value.d / duration;
+				break;
+			case MetricType::FloatMetric:
+				rate = slot.data.Value.f / duration;
+				break;
+			case MetricType::IntMetric:
+				rate = slot.data.Value.i / duration;
+				break;
+			case MetricType::UnsignedMetric:
+				rate = slot.data.Value.u / duration;
+				break;
+			default:
+				break;
+		}
+
+		for (size_t ii = 0; ii < SmoothedRateWindows.size(); ++ii)
+		{
+			auto& average = slot.smoothed_rates[ii];
+			average = slot.smoothed ? average + (1 - std::exp(-duration / SmoothedRateWindows[ii])) * (rate - average) : rate;
+		}
+		slot.smoothed = true;
+	}
+
+	void queueRecord_(size_t name_id, MetricData::MetricDataValue value, size_t unit_id, MetricType type, std::chrono::system_clock::time_point const& timestamp)
+	{
+		records_.push_back(MetricRecord{name_id, value, unit_id, type, timestamp});
+	}
+
+	void flushRecords_()
+	{
+		if (!records_.empty())
+		{
+			METLOG_P(TLVL_DEBUG + 44) << "Sending " << records_.size() << " metric records";
+			sendMetrics_(records_.data(), records_.size());
+			records_.clear();
+		}
+		// String values cannot be part of a MetricRecord batch, so sketches follow the percentiles they belong with
+		for (auto const& sketch : sketches_)
+		{
+			sendMetric_(recordString(sketch.name_id), sketch.text, recordString(sketch.unit_id), sketch.timestamp);
+		}
+		sketches_.clear();
+	}
+
+	size_t recordStringId_(std::string const& str)
+	{
+		auto it = recordStringIds_.find(str);
+		if (it != recordStringIds_.end())
+		{
+			return it->second;
 		}
+		recordStrings_.push_back(str);
+		recordStringIds_[str] = recordStrings_.size() - 1;
+		return recordStrings_.size() - 1;
 	}
 
 	void sendMetric_(std::string const& name, MetricData::MetricDataValue data, std::string const& unit, MetricType type, std::chrono::system_clock::time_point const& interval_end)
@@ -0,0 +1,366 @@
+#ifndef ARTDAQ_UTILITIES_PLUGINS_QUANTILESKETCH_HH
+#define ARTDAQ_UTILITIES_PLUGINS_QUANTILESKETCH_HH
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace artdaq {
+/// <summary>
+/// Mergeable quantile sketch with bounded relative error (DDSketch), used by MetricMode::Quantiles
+///
+/// Values are counted in logarithmically-spaced bins, so any quantile is estimated within the configured relative
+/// accuracy of the true value. Two sketches with the same accuracy can be merged exactly by adding their bins, which
+/// allows sketches from many processes to be combined into accurate overall quantiles. MetricPlugin reports the sketch of
+/// each interval in SerializeText form if "report_sketches" is set, so that they can be combined downstream. If a store would need more
+/// than MaxBins bins, its lowest bins are collapsed together, trading accuracy of the smallest magnitudes for bounded size.
+/// </summary>
+class QuantileSketch
+{
+public:
+	static constexpr double DefaultRelativeAccuracy = 0.01;  ///< Relative accuracy of quantile estimates, unless specified
+	static constexpr size_t MaxBins = 2048;                   ///< Maximum number of bins in each of the positive and negative stores
+	static constexpr double MinIndexableValue = 1e-12;        ///< Values with a smaller magnitude are counted as zero
+
+	/// <summary>
+	/// Construct an empty QuantileSketch
+	/// </summary>
+	/// <param name="relativeAccuracy">Relative accuracy of quantile estimates, between 0 and 1</param>
+	explicit QuantileSketch(double relativeAccuracy = DefaultRelativeAccuracy)
+	    : relative_accuracy_(relativeAccuracy)
+	    , gamma_((1 + relativeAccuracy) / (1 - relativeAccuracy))
+	    , log_gamma_(std::log(gamma_))
+	{}
+
+	/// <summary>
+	/// Add a value to the sketch
+	/// </summary>
+	/// <param name="value">Value to add</param>
+	/// <param name="count">Number of times to add the value</param>
+	void Add(double value, uint64_t count = 1)
+	{
+		if (std::isnan(value) || count == 0) return;
+
+		if (value >= MinIndexableValue)
+		{
+			positive_.add(index_(value), count);
+		}
+		else if (value <= -MinIndexableValue)
+		{
+			negative_.add(index_(-value), count);
+		}
+		else
+		{
+			zero_count_ += count;
+		}
+		count_ += count;
+	}
+
+	/// <summary>
+	/// Merge the contents of another sketch into this one
+	/// </summary>
+	/// <param name="other">Sketch to merge</param>
+	/// <returns>True if the sketches have the same accuracy and were merged, false otherwise</returns>
+	bool Merge(QuantileSketch const& other)
+	{
+		if (other.relative_accuracy_ != relative_accuracy_) return false;
+
+		for (size_t ii = 0; ii < other.positive_.bins.size(); ++ii)
+		{
+			if (other.positive_.bins[ii] > 0) positive_.add(other.positive_.offset + static_cast<int>(ii), other.positive_.bins[ii]);
+		}
+		for (size_t ii = 0; ii < other.negative_.bins.size(); ++ii)
+		{
+			if (other.negative_.bins[ii] > 0) negative_.add(other.negative_.offset + static_cast<int>(ii), other.negative_.bins[ii]);
+		}
+		zero_count_ += other.zero_count_;
+		count_ += other.count_;
+		return true;
+	}
+
+	/// <summary>
+	/// Estimate a quantile of the values in the sketch
+	/// </summary>
+	/// <param name="quantile">Quantile to estimate, from 0 to 1</param>
+	/// <returns>Estimated value of the quantile, 0 if the sketch is empty</returns>
+	double Quantile(double quantile) const
+	{
+		if (count_ == 0) return 0.0;
+		if (quantile < 0) quantile = 0;
+		if (quantile > 1) quantile = 1;
+
+		auto rank = quantile * static_cast<double>(count_ - 1);
+		uint64_t seen = 0;
+		for (size_t ii = negative_.bins.size(); ii > 0; --ii)
+		{
+			seen += negative_.bins[ii - 1];
+			if (static_cast<double>(seen) > rank) return -value_(negative_.offset + static_cast<int>(ii - 1));
+		}
+		seen += zero_count_;
+		if (static_cast<double>(seen) > rank) return 0.0;
+		for (size_t ii = 0; ii < positive_.bins.size(); ++ii)
+		{
+			seen += positive_.bins[ii];
+			if (static_cast<double>(seen) > rank) return value_(positive_.offset + static_cast<int>(ii));
+		}
+		return positive_.bins.empty() ? 0.0 : value_(positive_.offset + static_cast<int>(positive_.bins.size() - 1));
+	}
+
+	/// <summary>
+	/// Get the number of values in the sketch
+	/// </summary>
+	/// <returns>The number of values in the sketch</returns>
+	uint64_t Count() const { return count_; }
+
+	/// <summary>
+	/// Get the relative accuracy of the sketch
+	/// </summary>
+	/// <returns>The relative accuracy of the sketch</returns>
+	double RelativeAccuracy() const { return relative_accuracy_; }
+
+	/// <summary>
+	/// Remove all values from the sketch, keeping its allocated bins
+	/// </summary>
+	void Clear()
+	{
+		positive_.clear();
+		negative_.clear();
+		zero_count_ = 0;
+		count_ = 0;
+	}
+
+	/// <summary>
+	/// Serialize the sketch into a compact binary form
+	///
+	/// Format: version byte, relative accuracy (IEEE double, little-endian), zero count, then for the positive and
+	/// negative stores: bin offset (zigzag), bin count and bin contents. All integers are LEB128 varints.
+	/// </summary>
+	/// <returns>Binary representation of the sketch</returns>
+	std::string Serialize() const
+	{
+		std::string output;
+		output.push_back(static_cast<char>(SerializationVersion));
+
+		uint64_t accuracy_bits = 0;
+		std::memcpy(&accuracy_bits, &relative_accuracy_, sizeof(accuracy_bits));
+		for (int ii = 0; ii < 8; ++ii)
+		{
+			output.push_back(static_cast<char>((accuracy_bits >> (8 * ii)) & 0xFF));
+		}
+
+		putVarint_(output, zero_count_);
+		for (auto store : {&positive_, &negative_})
+		{
+			auto offset = static_cast<int64_t>(store->offset);
+			putVarint_(output, (static_cast<uint64_t>(offset) << 1) ^ static_cast<uint64_t>(offset >> 63));
+			putVarint_(output, store->bins.size());
+			for (auto count : store->bins)
+			{
+				putVarint_(output, count);
+			}
+		}
+		return output;
+	}
+
+	/// <summary>
+	/// Restore a sketch from the output of Serialize
+	/// </summary>
+	/// <param name="data">Binary representation of a sketch</param>
+	/// <param name="sketch">Sketch to fill. Unchanged if data is not a valid sketch</param>
+	/// <returns>True if data was a valid sketch, false otherwise</returns>
+	static bool Deserialize(std::string const& data, QuantileSketch& sketch)
+	{
+		size_t pos = 0;
+		if (data.size() < 9 || static_cast<uint8_t>(data[pos++]) != SerializationVersion) return false;
+
+		uint64_t accuracy_bits = 0;
+		for (int ii = 0; ii < 8; ++ii)
+		{
+			accuracy_bits |= static_cast<uint64_t>(static_cast<uint8_t>(data[pos++])) << (8 * ii);
+		}
+		double accuracy = 0;
+		std::memcpy(&accuracy, &accuracy_bits, sizeof(accuracy));
+		if (!(accuracy > 0 && accuracy < 1)) return false;
+
+		QuantileSketch output(accuracy);
+		if (!getVarint_(data, pos, output.zero_count_)) return false;
+		output.count_ = output.zero_count_;
+		for (auto store : {&output.positive_, &output.negative_})
+		{
+			uint64_t zigzag = 0;
+			uint64_t size = 0;
+			if (!getVarint_(data, pos, zigzag) || !getVarint_(data, pos, size) || size > MaxBins) return false;
+			store->offset = static_cast<int>(static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1));
+			store->bins.resize(size);
+			for (auto& count : store->bins)
+			{
+				if (!getVarint_(data, pos, count)) return false;
+				output.count_ += count;
+			}
+		}
+		if (pos != data.size()) return false;
+
+		sketch = std::move(output);
+		return true;
+	}
+
+	/// <summary>
+	/// Serialize the sketch as text, for metric back-ends which only store strings: the output of Serialize, in base64
+	/// </summary>
+	/// <returns>Text representation of the sketch</returns>
+	std::string SerializeText() const
+	{
+		static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		auto data = Serialize();
+		std::string output;
+		output.reserve((data.size() + 2) / 3 * 4);
+		for (size_t pos = 0; pos < data.size(); pos += 3)
+		{
+			uint32_t group = static_cast<uint32_t>(static_cast<uint8_t>(data[pos])) << 16;
+			if (pos + 1 < data.size()) group |= static_cast<uint32_t>(static_cast<uint8_t>(data[pos + 1])) << 8;
+			if (pos + 2 < data.size()) group |= static_cast<uint32_t>(static_cast<uint8_t>(data[pos + 2]));
+			output.push_back(alphabet[(group >> 18) & 0x3F]);
+			output.push_back(alphabet[(group >> 12) & 0x3F]);
+			output.push_back(pos + 1 < data.size() ? alphabet[(group >> 6) & 0x3F] : '=');
+			output.push_back(pos + 2 < data.size() ? alphabet[group & 0x3F] : '=');
+		}
+		return output;
+	}
+
+	/// <summary>
+	/// Restore a sketch from the output of SerializeText
+	/// </summary>
+	/// <param name="text">Text representation of a sketch</param>
+	/// <param name="sketch">Sketch to fill. Unchanged if text is not a valid sketch</param>
+	/// <returns>True if text was a valid sketch, false otherwise</returns>
+	static bool DeserializeText(std::string const& text, QuantileSketch& sketch)
+	{
+		if (text.size() % 4 != 0) return false;
+
+		std::string data;
+		data.reserve(text.size() / 4 * 3);
+		for (size_t pos = 0; pos < text.size(); pos += 4)
+		{
+			uint32_t group = 0;
+			int padding = 0;
+			for (size_t ii = 0; ii < 4; ++ii)
+			{
+				auto ch = text[pos + ii];
+				int value = 0;
+				if (ch >= 'A' && ch <= 'Z') value = ch - 'A';
+				else if (ch >= 'a' && ch <= 'z') value = ch - 'a' + 26;
+				else if (ch >= '0' && ch <= '9') value = ch - '0' + 52;
+				else if (ch == '+') value = 62;
+				else if (ch == '/') value = 63;
+				else if (ch == '=' && ii >= 2 && pos + 4 == text.size()) ++padding;
+				else return false;
+				if (padding > 0 && ch != '=') return false;
+				group = (group << 6) | static_cast<uint32_t>(value);
+			}
+			data.push_back(static_cast<char>((group >> 16) & 0xFF));
+			if (padding < 2) data.push_back(static_cast<char>((group >> 8) & 0xFF));
+			if (padding < 1) data.push_back(static_cast<char>(group & 0xFF));
+		}
+		return Deserialize(data, sketch);
+	}
+
+private:
+	static constexpr uint8_t SerializationVersion = 1;
+
+	/// Contiguous bin counts, bins[i] holding the values with index offset + i
+	struct Store
+	{
+		int offset{0};
+		std::vector<uint64_t> bins;
+
+		void add(int index, uint64_t count)
+		{
+			if (bins.empty())
+			{
+				offset = index;
+				bins.push_back(0);
+			}
+
+			auto highest = offset + static_cast<int>(bins.size()) - 1;
+			if (index > highest)
+			{
+				auto lowest = index - static_cast<int>(MaxBins) + 1;
+				if (lowest > offset) collapseBelow(lowest);
+				bins.resize(static_cast<size_t>(index - offset + 1), 0);
+			}
+			else if (index < offset)
+			{
+				auto lowest = highest - static_cast<int>(MaxBins) + 1;
+				if (index < lowest) index = lowest;
+				if (index < offset)
+				{
+					bins.insert(bins.begin(), static_cast<size_t>(offset - index), 0);
+					offset = index;
+				}
+			}
+			bins[static_cast<size_t>(index - offset)] += count;
+		}
+
+		void collapseBelow(int lowest)
+		{
+			auto drop = std::min(bins.size(), static_cast<size_t>(lowest - offset));
+			uint64_t folded = 0;
+			for (size_t ii = 0; ii < drop; ++ii)
+			{
+				folded += bins[ii];
+			}
+			bins.erase(bins.begin(), bins.begin() + static_cast<std::ptrdiff_t>(drop));
+			offset = lowest;
+			if (bins.empty()) bins.push_back(0);
+			bins[0] += folded;
+		}
+
+		void clear()
+		{
+			offset = 0;
+			bins.clear();
+		}
+	};
+
+	int index_(double magnitude) const { return static_cast<int>(std::ceil(std::log(magnitude) / log_gamma_)); }
+
+	double value_(int index) const { return 2 * std::exp(index * log_gamma_) / (gamma_ + 1); }
+
+	static void putVarint_(std::string& output, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			output.push_back(static_cast<char>((value & 0x7F) | 0x80));
+			value >>= 7;
+		}
+		output.push_back(static_cast<char>(value));
+	}
+
+	static bool getVarint_(std::string const& data, size_t& pos, uint64_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64 && pos < data.size(); shift += 7)
+		{
+			auto byte = static_cast<uint8_t>(data[pos++]);
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	double relative_accuracy_;
+	double gamma_;
+	double log_gamma_;
+	Store positive_;
+	Store negative_;
+	uint64_t zero_count_{0};
+	uint64_t count_{0};
+};
+}  // namespace artdaq
+
+#endif /* ARTDAQ_UTILITIES_PLUGINS_QUANTILESKETCH_HH */
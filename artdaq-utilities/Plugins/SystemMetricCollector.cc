@@ -210,42 +210,58 @@ std::list<std::string> artdaq::SystemMetricCollector::GetNetworkInterfaceNames()
 
 std::list<std::unique_ptr<artdaq::MetricData>> artdaq::SystemMetricCollector::SendMetrics()
 {
-	auto start_time = std::chrono::steady_clock::now();
+	MetricDataPool pool;
+	SendMetrics(pool);
+
 	std::list<std::unique_ptr<MetricData>> output;
+	for (auto& metric : pool)
+	{
+		output.emplace_back(new MetricData(std::move(metric)));
+	}
+	return output;
+}
+
+void artdaq::SystemMetricCollector::SendMetrics(MetricDataPool& pool)
+{
+	auto start_time = std::chrono::steady_clock::now();
 	if (sendProcessMetrics_)
 	{
-		output.emplace_back(new MetricData("Process CPU Usage", GetProcessCPUUsagePercent(), "%", MLEVEL_PROCESS, MetricMode::Average, "", false));
-		output.emplace_back(new MetricData("Process RAM Usage", GetProcessMemUsage(), "B", MLEVEL_PROCESS, MetricMode::LastPoint, "", false));
+		pool.Add("Process CPU Usage", GetProcessCPUUsagePercent(), "%", MLEVEL_PROCESS, MetricMode::Average, "", false);
+		pool.Add("Process RAM Usage", GetProcessMemUsage(), "B", MLEVEL_PROCESS, MetricMode::LastPoint, "", false);
 	}
 	if (sendSystemMetrics_)
 	{
 		GetSystemCPUUsage();
-		output.emplace_back(new MetricData("System CPU Usage", nonIdleCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false));
-		output.emplace_back(new MetricData("System CPU User", userCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false));
-		output.emplace_back(new MetricData("System CPU System", systemCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false));
-		output.emplace_back(new MetricData("System CPU Idle", idleCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false));
-		output.emplace_back(new MetricData("System CPU IOWait", iowaitCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false));
-		output.emplace_back(new MetricData("System CPU IRQ", irqCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false));
-
-		output.emplace_back(new MetricData("Free RAM", GetAvailableRAM(), "B", MLEVEL_RAM, MetricMode::LastPoint, "", false));
-		output.emplace_back(new MetricData("Total RAM", GetTotalRAM(), "B", MLEVEL_RAM, MetricMode::LastPoint, "", false));
-		output.emplace_back(new MetricData("Available RAM", GetAvailableRAMPercent(true), "%", MLEVEL_RAM, MetricMode::LastPoint, "", false));
-
-		for (auto& ifname : GetNetworkInterfaceNames())
+		pool.Add("System CPU Usage", nonIdleCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false);
+		pool.Add("System CPU User", userCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false);
+		pool.Add("System CPU System", systemCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false);
+		pool.Add("System CPU Idle", idleCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false);
+		pool.Add("System CPU IOWait", iowaitCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false);
+		pool.Add("System CPU IRQ", irqCPUPercent_, "%", MLEVEL_CPU, MetricMode::Average, "", false);
+
+		pool.Add("Free RAM", GetAvailableRAM(), "B", MLEVEL_RAM, MetricMode::LastPoint, "", false);
+		pool.Add("Total RAM", GetTotalRAM(), "B", MLEVEL_RAM, MetricMode::LastPoint, "", false);
+		pool.Add("Available RAM", GetAvailableRAMPercent(true), "%", MLEVEL_RAM, MetricMode::LastPoint, "", false);
+
+		// Read the interface statistics once, then walk them in place rather than looking each one up by a copied name
+		UpdateNetstat_();
+		netstat none;
+		for (auto& stat : thisNetStat_.stats)
 		{
-			output.emplace_back(new MetricData(ifname + " Network Receive Rate", GetNetworkReceiveBytes(ifname), "B", MLEVEL_NETWORK, MetricMode::Rate, "", false));
-			output.emplace_back(new MetricData(ifname + " Network Send Rate", GetNetworkSendBytes(ifname), "B", MLEVEL_NETWORK, MetricMode::Rate, "", false));
-			output.emplace_back(new MetricData(ifname + " Network Send Errors", GetNetworkSendErrors(ifname), "Errors", MLEVEL_NETWORK, MetricMode::Accumulate, "", false));
-			output.emplace_back(new MetricData(ifname + " Network Receive Errors", GetNetworkReceiveErrors(ifname), "Errors", MLEVEL_NETWORK, MetricMode::Accumulate, "", false));
+			auto last_it = lastNetStat_.stats.find(stat.first);
+			auto const& last = last_it != lastNetStat_.stats.end() ? last_it->second : none;
+			pool.Add(stat.first, stat.second.recv_bytes - last.recv_bytes, "B", MLEVEL_NETWORK, MetricMode::Rate, "", false).Name += " Network Receive Rate";
+			pool.Add(stat.first, stat.second.send_bytes - last.send_bytes, "B", MLEVEL_NETWORK, MetricMode::Rate, "", false).Name += " Network Send Rate";
+			pool.Add(stat.first, stat.second.send_errs - last.send_errs, "Errors", MLEVEL_NETWORK, MetricMode::Accumulate, "", false).Name += " Network Send Errors";
+			pool.Add(stat.first, stat.second.recv_errs - last.recv_errs, "Errors", MLEVEL_NETWORK, MetricMode::Accumulate, "", false).Name += " Network Receive Errors";
 		}
-		output.emplace_back(new MetricData("Network TCP RetransSegs", GetNetworkTCPRetransSegs(), "Segs", MLEVEL_NETWORK, MetricMode::Rate, "", false));
+		pool.Add("Network TCP RetransSegs", GetNetworkTCPRetransSegs(), "Segs", MLEVEL_NETWORK, MetricMode::Rate, "", false);
 	}
 
 	TLOG(TLVL_DEBUG + 35)
 	    << "Time to collect system metrics: "
 	    << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count()
 	    << " us.";
-	return output;
 }
 
 artdaq::SystemMetricCollector::cpustat artdaq::SystemMetricCollector::ReadProcStat_()
@@ -103,6 +103,12 @@ public:
 	/// <returns>A list of MetricData pointers for direct injection into MetricManager</returns>
 	std::list<std::unique_ptr<MetricData>> SendMetrics();
 
+	/// <summary>
+	/// Send the configured metrics into a reusable pool, without allocating once the pool has grown to hold them
+	/// </summary>
+	/// <param name="pool">MetricDataPool to add the metrics to</param>
+	void SendMetrics(MetricDataPool& pool);
+
 private:
 	struct cpustat
 	{
@@ -193,6 +193,42 @@ public:
 		sendMetric_(name, std::to_string(value), unit, time);
 	}
 
+	/**
+	 * \brief Write all values reported in an interval to the file, flushing it once
+	 * \param records The reported values
+	 * \param count The number of reported values
+	 */
+	void sendMetrics_(MetricRecord const* records, size_t count) override
+	{
+		if (stopped_ || inhibit_)
+		{
+			return;
+		}
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			getTime_(outputStream_, records[ii].timestamp) << "FileMetric: " << recordString(records[ii].name_id) << ": ";
+			switch (records[ii].type)
+			{
+				case MetricType::DoubleMetric:
+					outputStream_ << std::to_string(records[ii].value.d);
+					break;
+				case MetricType::FloatMetric:
+					outputStream_ << std::to_string(records[ii].value.f);
+					break;
+				case MetricType::IntMetric:
+					outputStream_ << std::to_string(records[ii].value.i);
+					break;
+				case MetricType::UnsignedMetric:
+					outputStream_ << std::to_string(records[ii].value.u);
+					break;
+				default:
+					break;
+			}
+			outputStream_ << " " << recordString(records[ii].unit_id) << ".\n";
+		}
+		outputStream_.flush();
+	}
+
 	/**
 	 * \brief Perform startup actions. Writes start message to output file.
 	 */
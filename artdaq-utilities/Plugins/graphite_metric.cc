@@ -11,16 +11,349 @@
 #include "fhiclcpp/ParameterSet.h"
 #include "messagefacility/MessageLogger/MessageLogger.h"
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <algorithm>
 #include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 
 namespace artdaq {
+/**
+ * \brief Bounded, append-only store of Graphite lines on disk, used while the Graphite relay cannot be reached
+ *
+ * Lines are appended to memory-mapped segment files of a fixed size, and read back in order. Fully-read segments are
+ * deleted, and when the spool would exceed its maximum size, the oldest segment is deleted to make room. The unused end
+ * of a segment is zero, so segments left behind by a previous process are found and read back when a spool is created
+ * with the same directory and file prefix. Each prefix is locked by one spool at a time, and segment files are
+ * allocated on disk before they are mapped, so that a full disk drops lines instead of faulting on write.
+ */
+class GraphiteSpool
+{
+public:
+	/**
+	 * \brief GraphiteSpool Constructor. Creates the directory if needed, locks the prefix, and picks up existing segment
+	 * files. The spool is disabled if the prefix is locked by another process.
+	 * \param directory Directory holding the segment files
+	 * \param prefix Prefix of the segment file names
+	 * \param maxSize Maximum size of all segment files, in bytes
+	 * \param segmentSize Size of each segment file, in bytes
+	 */
+	GraphiteSpool(std::string const& directory, std::string const& prefix, size_t maxSize, size_t segmentSize)
+	    : directory_(directory)
+	    , prefix_(prefix)
+	    , maxSegments_(std::max(size_t(1), maxSize / std::max(size_t(1), segmentSize)))
+	    , segmentSize_(segmentSize)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(directory_, error);
+		if (error)
+		{
+			TLOG(TLVL_WARNING, "GraphiteSpool") << "Cannot create spool directory " << directory_ << ": " << error.message();
+			return;
+		}
+
+		// Held until destruction, so that no other process reads or replaces these segments
+		auto lockPath = directory_ + "/" + prefix_ + "spool.lock";
+		lockFd_ = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (lockFd_ < 0 || flock(lockFd_, LOCK_EX | LOCK_NB) != 0)
+		{
+			TLOG(TLVL_WARNING, "GraphiteSpool") << "Cannot lock spool " << lockPath << ", metrics will not be spooled: "
+			                                    << (errno == EWOULDBLOCK ? "in use by another process" : std::strerror(errno));
+			return;
+		}
+
+		std::vector<std::string> existing;
+		for (auto const& entry : std::filesystem::directory_iterator(directory_, error))
+		{
+			// <prefix><10-digit sequence number>.spool
+			auto name = entry.path().filename().string();
+			if (name.size() == prefix_.size() + 16 && name.compare(0, prefix_.size(), prefix_) == 0 && name.compare(name.size() - 6, 6, ".spool") == 0 &&
+			    std::all_of(name.begin() + static_cast<std::ptrdiff_t>(prefix_.size()), name.end() - 6, [](char ch) { return ch >= '0' && ch <= '9'; }))
+			{
+				existing.push_back(name);
+			}
+		}
+		std::sort(existing.begin(), existing.end());  // Sequence numbers are zero-padded
+		for (auto const& name : existing)
+		{
+			nextSequence_ = std::max<uint64_t>(nextSequence_, std::strtoull(name.c_str() + prefix_.size(), nullptr, 10) + 1);
+			Segment segment;
+			if (map_(segment, directory_ + "/" + name, 0))
+			{
+				auto end = static_cast<char*>(std::memchr(segment.data, '\0', segment.size));
+				segment.write = end != nullptr ? static_cast<size_t>(end - segment.data) : segment.size;
+				segment.sealed = true;
+				segments_.push_back(segment);
+			}
+		}
+		if (!segments_.empty())
+		{
+			TLOG(TLVL_INFO, "GraphiteSpool") << "Found " << Size() << " bytes of metrics spooled in " << directory_ << " by a previous process";
+		}
+		enabled_ = true;
+	}
+
+	/**
+	 * \brief GraphiteSpool Destructor. Unmaps the segments; those with unread lines are left on disk. Releases the lock.
+	 */
+	~GraphiteSpool()
+	{
+		for (auto& segment : segments_)
+		{
+			unmap_(segment, segment.read == segment.write);
+		}
+		if (lockFd_ >= 0)
+		{
+			close(lockFd_);  // Releases the lock. The lock file is kept, as removing it could let two processes lock it.
+		}
+	}
+
+	GraphiteSpool(GraphiteSpool const&) = delete;             ///< Copy Constructor is deleted
+	GraphiteSpool(GraphiteSpool&&) = delete;                  ///< Move Constructor is deleted
+	GraphiteSpool& operator=(GraphiteSpool const&) = delete;  ///< Copy Assignment Operator is deleted
+	GraphiteSpool& operator=(GraphiteSpool&&) = delete;       ///< Move Assignment Operator is deleted
+
+	/**
+	 * \brief Whether the spool directory could be used
+	 * \return True if lines can be spooled
+	 */
+	bool Enabled() const { return enabled_; }
+
+	/**
+	 * \brief Get the number of unread bytes in the spool
+	 * \return The number of unread bytes
+	 */
+	size_t Size() const
+	{
+		size_t size = 0;
+		for (auto const& segment : segments_)
+		{
+			size += segment.write - segment.read;
+		}
+		return size;
+	}
+
+	/**
+	 * \brief Append lines to the spool
+	 * \param data Complete lines, each ending in a newline
+	 * \param size Number of bytes
+	 * \return The number of unread bytes deleted to stay within the maximum size, or lost because they could not be written
+	 */
+	size_t Append(char const* data, size_t size)
+	{
+		size_t dropped = 0;
+		while (size > 0)
+		{
+			if (segments_.empty() || segments_.back().sealed)
+			{
+				if (!enabled_ || !addSegment_(dropped))
+				{
+					return dropped + size;
+				}
+			}
+
+			auto& segment = segments_.back();
+			auto space = segment.size - segment.write;
+			auto count = size;
+			if (count > space)
+			{
+				// Fill the segment with whole lines, and continue in a new one
+				count = 0;
+				for (auto ii = space; ii > 0; --ii)
+				{
+					if (data[ii - 1] == '\n')
+					{
+						count = ii;
+						break;
+					}
+				}
+				segment.sealed = true;
+				if (count == 0 && segment.write == 0)
+				{
+					return dropped + size;  // A line longer than a segment
+				}
+			}
+			std::memcpy(segment.data + segment.write, data, count);
+			segment.write += count;
+			data += count;
+			size -= count;
+		}
+		return dropped;
+	}
+
+	/**
+	 * \brief Get the oldest unread lines. They remain valid until the next call to Consume or Append.
+	 * \param maxSize Maximum number of bytes, unless the first line is longer
+	 * \return Pointer to the lines and their size, which is zero if the spool is empty
+	 */
+	std::pair<char const*, size_t> Front(size_t maxSize)
+	{
+		while (!segments_.empty() && segments_.front().read == segments_.front().write)
+		{
+			if (!segments_.front().sealed && segments_.front().write == 0) break;
+			unmap_(segments_.front(), true);
+			segments_.pop_front();
+		}
+		if (segments_.empty())
+		{
+			return {nullptr, 0};
+		}
+
+		auto const& segment = segments_.front();
+		auto start = segment.data + segment.read;
+		auto size = segment.write - segment.read;
+		if (size > maxSize)
+		{
+			auto end = static_cast<char const*>(std::memchr(start + maxSize, '\n', size - maxSize));
+			for (auto ii = maxSize; ii > 0; --ii)
+			{
+				if (start[ii - 1] == '\n')
+				{
+					end = start + ii - 1;
+					break;
+				}
+			}
+			size = end != nullptr ? static_cast<size_t>(end - start) + 1 : size;
+		}
+		return {start, size};
+	}
+
+	/**
+	 * \brief Mark lines returned by Front as read
+	 * \param size Number of bytes read
+	 */
+	void Consume(size_t size)
+	{
+		if (!segments_.empty())
+		{
+			segments_.front().read += size;
+		}
+	}
+
+private:
+	struct Segment
+	{
+		std::string path;
+		int fd{-1};
+		char* data{nullptr};
+		size_t size{0};
+		size_t write{0};      // End of the lines written
+		size_t read{0};       // End of the lines read
+		bool sealed{false};  // Whether no more lines will be written to this segment
+	};
+
+	bool addSegment_(size_t& dropped)
+	{
+		while (segments_.size() >= maxSegments_)
+		{
+			dropped += segments_.front().write - segments_.front().read;
+			unmap_(segments_.front(), true);
+			segments_.pop_front();
+		}
+
+		std::ostringstream path;
+		path << directory_ << "/" << prefix_ << std::setw(10) << std::setfill('0') << nextSequence_++ << ".spool";
+		Segment segment;
+		if (!map_(segment, path.str(), segmentSize_))
+		{
+			return false;
+		}
+		segments_.push_back(segment);
+		return true;
+	}
+
+	// Map an existing segment file (size 0), or create one of the given size. New files are allocated on disk first, as
+	// writing to an unallocated page of the mapping when the disk is full would raise SIGBUS.
+	bool map_(Segment& segment, std::string const& path, size_t size)
+	{
+		segment.path = path;
+		segment.fd = open(path.c_str(), size > 0 ? O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0644);
+		auto created = size > 0 && segment.fd >= 0;  // Never remove a file this spool did not create
+		auto error = segment.fd < 0 ? errno : 0;
+		if (created)
+		{
+			error = posix_fallocate(segment.fd, 0, static_cast<off_t>(size));
+		}
+		struct stat info;
+		if (error == 0 && fstat(segment.fd, &info) != 0)
+		{
+			error = errno;
+		}
+		if (error != 0 || info.st_size == 0)
+		{
+			TLOG(TLVL_WARNING, "GraphiteSpool") << "Cannot use spool file " << path << ": " << (error != 0 ? std::strerror(error) : "empty");
+			unmap_(segment, created);
+			return false;
+		}
+		segment.size = static_cast<size_t>(info.st_size);
+		auto data = mmap(nullptr, segment.size, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+		if (data == MAP_FAILED)
+		{
+			TLOG(TLVL_WARNING, "GraphiteSpool") << "Cannot map spool file " << path << ": " << std::strerror(errno);
+			unmap_(segment, created);
+			return false;
+		}
+		segment.data = static_cast<char*>(data);
+		return true;
+	}
+
+	void unmap_(Segment& segment, bool remove)
+	{
+		if (segment.data != nullptr)
+		{
+			munmap(segment.data, segment.size);
+			segment.data = nullptr;
+		}
+		if (segment.fd >= 0)
+		{
+			close(segment.fd);
+			segment.fd = -1;
+		}
+		if (remove)
+		{
+			unlink(segment.path.c_str());
+		}
+	}
+
+	std::string directory_;
+	std::string prefix_;
+	size_t maxSegments_;
+	size_t segmentSize_;
+	int lockFd_{-1};
+	bool enabled_{false};
+	uint64_t nextSequence_{0};
+	std::deque<Segment> segments_;  // Oldest first. Only the last one can be unsealed.
+};
+
 /**
  * \brief Send a metric to Graphite
  *
@@ -30,18 +363,80 @@ namespace artdaq {
  *     Fragment_Rate
  *
  *  This plugin sends TCP messages with the following content: [name] [value] [timestamp], units are discarded
+ *  With protocol "pickle", it instead sends length-prefixed pickled lists of (name, (timestamp, value)) tuples to
+ *  Carbon's pickle receiver, which is cheaper for the relay to parse. With transport "udp", plaintext lines are instead
+ *  packed into datagrams of up to udp_mtu bytes, sent without blocking, and dropped if the socket buffer is full.
+ *
+ *  The lines reported in an interval are collected in one buffer, which is queued when it reaches max_batch_size bytes
+ *  and at the end of the interval. The socket is driven asynchronously by a thread owned by the plugin, which writes the
+ *  queued batches and reconnects with exponential backoff, so the thread sending metrics never waits for Graphite.
+ *
+ *  If spool_directory is set, lines which cannot be written while Graphite is unreachable are kept in a GraphiteSpool,
+ *  and written after reconnecting, at most spool_replay_rate bytes per second, with their original timestamps.
  */
 class GraphiteMetric final : public MetricPlugin
 {
 private:
+	enum class Protocol
+	{
+		Plaintext,
+		Pickle
+	};
+
+	enum class Transport
+	{
+		TCP,
+		UDP
+	};
+
 	std::string host_;
+	Protocol protocol_;
+	Transport transport_;
 	int port_;
 	std::string namespace_;
+	size_t maxBatchSize_;
+	size_t maxQueuedBytes_;
+	std::chrono::steady_clock::duration connectTimeout_;
+	std::chrono::steady_clock::duration minBackoff_;
+	std::chrono::steady_clock::duration maxBackoff_;
+	std::string batch_;                     // Lines being collected by the sending thread
+	std::vector<std::string> recordNames_;  // Output names (namespace and metric name), indexed by record name id
+	bool stopped_;
+
+	// Shared by the sending thread and the I/O thread
+	std::mutex mutex_;
+	std::deque<std::string> pending_;  // Batches waiting to be written
+	size_t pendingBytes_{0};
+	std::vector<std::string> spare_;  // Written batches, kept to reuse their storage
+	std::condition_variable stoppedCV_;
+	bool ioStopped_{false};  // Whether the I/O thread has run out of work
+
+	// Only used by the I/O thread
 	boost::asio::io_service io_service_;
+	boost::asio::executor_work_guard<boost::asio::io_service::executor_type> work_;
+	tcp::resolver resolver_;
 	tcp::socket socket_;
-	bool stopped_;
-	int errorCount_;
-	std::chrono::steady_clock::time_point waitStart_;
+	udp::socket udpSocket_;                // Used instead of socket_ with the UDP transport
+	size_t mtu_;                           // Maximum size of a datagram
+	std::vector<struct iovec> datagrams_;  // Lines of the batch being sent in each datagram
+	std::vector<struct mmsghdr> messages_;
+	boost::asio::steady_timer timer_;  // Connect timeout, then reconnect backoff
+	std::string writing_;              // Batch being written
+	bool connected_{false};
+	bool connecting_{false};  // Connecting, or waiting to retry
+	bool backingOff_{false};  // Waiting to retry
+	bool inFlight_{false};    // Whether writing_ is being written
+	bool closing_{false};     // Close the connection once the queued batches are written
+	bool finished_{false};    // The plugin is being destroyed: do not connect again
+	size_t attempts_{0};
+	std::chrono::steady_clock::duration backoff_;
+	std::unique_ptr<GraphiteSpool> spool_;  // Lines kept while Graphite is unreachable, if enabled
+	double replayRate_;                     // Bytes per second written from spool_, 0 for no limit
+	boost::asio::steady_timer replayTimer_;
+	bool replayWaiting_{false};                         // Whether replayTimer_ is running
+	std::chrono::steady_clock::time_point replayNext_;  // When the next write from spool_ is allowed
+	size_t replaying_{0};                               // Bytes of spool_ being written
+	boost::thread thread_;
 
 public:
 	/**
@@ -53,28 +448,105 @@ public:
 	 * \verbatim
 	 * GraphiteMetric accepts the following Parameters:
 	 * "host" (Default: "localhost"): Destination host
-	 * "port" (Default: 2003): Destination port
+	 * "protocol" (Default: "plaintext"): Carbon receiver protocol, "plaintext" or "pickle"
+	 * "transport" (Default: "tcp"): "tcp", or "udp" to send plaintext lines in datagrams, which are dropped rather than
+	 * waited for when the network or relay is not keeping up
+	 * "udp_mtu" (Default: 1472): Maximum number of bytes of lines in each datagram. Lines are not split between datagrams
+	 * "port" (Default: 2003, or 2004 for pickle): Destination port
 	 * "namespace" (Default: "artdaq."): Directory name to prepend to all metrics. Should include the trailing '.'
+	 * "max_batch_size" (Default: 65536): Number of bytes of metric lines collected before they are queued for writing.
+	 * With pickle, each batch is one message, which Carbon limits to 1 MiB
+	 * "max_queued_bytes" (Default: 16777216): Maximum number of bytes waiting to be written. The oldest batches are dropped beyond this
+	 * "connect_timeout" (Default: 5.0): Seconds to wait for a connection to Graphite
+	 * "reconnect_min_interval" (Default: 1.0): Seconds to wait before the first reconnection attempt. Doubles with each failed attempt
+	 * "reconnect_max_interval" (Default: 60.0): Maximum number of seconds to wait between reconnection attempts
+	 * "spool_directory" (Default: ""): Directory to keep metrics in while Graphite is unreachable. If empty, they are dropped.
+	 * Only used with plaintext over TCP
+	 * "spool_max_size" (Default: 268435456): Maximum number of bytes kept in the spool. The oldest are dropped beyond this
+	 * "spool_segment_size" (Default: 16777216): Size of each spool file, in bytes
+	 * "spool_replay_rate" (Default: 1048576): Bytes per second written from the spool after reconnecting. 0 for no limit
 	 * \endverbatim
 	 */
 	explicit GraphiteMetric(fhicl::ParameterSet const& config, std::string const& app_name, std::string const& metric_name)
 	    : MetricPlugin(config, app_name, metric_name)
 	    , host_(pset.get<std::string>("host", "localhost"))
-	    , port_(pset.get<int>("port", 2003))
+	    , protocol_(protocolFromString_(pset.get<std::string>("protocol", "plaintext")))
+	    , transport_(transportFromString_(pset.get<std::string>("transport", "tcp")))
+	    , port_(pset.get<int>("port", protocol_ == Protocol::Pickle ? 2004 : 2003))
 	    , namespace_(pset.get<std::string>("namespace", "artdaq."))
+	    , maxBatchSize_(pset.get<size_t>("max_batch_size", 65536))
+	    , maxQueuedBytes_(pset.get<size_t>("max_queued_bytes", 16777216))
+	    , connectTimeout_(seconds_(pset.get<double>("connect_timeout", 5.0)))
+	    , minBackoff_(seconds_(pset.get<double>("reconnect_min_interval", 1.0)))
+	    , maxBackoff_(seconds_(pset.get<double>("reconnect_max_interval", 60.0)))
+	    , stopped_(true)
 	    , io_service_()
+	    , work_(boost::asio::make_work_guard(io_service_))
+	    , resolver_(io_service_)
 	    , socket_(io_service_)
-	    , stopped_(true)
-	    , errorCount_(0)
+	    , udpSocket_(io_service_)
+	    , mtu_(pset.get<size_t>("udp_mtu", 1472))
+	    , timer_(io_service_)
+	    , backoff_(minBackoff_)
+	    , replayRate_(pset.get<double>("spool_replay_rate", 1048576))
+	    , replayTimer_(io_service_)
 	{
 		METLOG(TLVL_DEBUG + 32) << "GraphiteMetric ctor";
+		if (transport_ == Transport::UDP && protocol_ == Protocol::Pickle)
+		{
+			throw cet::exception("Configuration Error")  // NOLINT(cert-err60-cpp)
+			    << "The Graphite pickle protocol is only supported with the TCP transport";
+		}
+		auto spoolDirectory = pset.get<std::string>("spool_directory", "");
+		if (!spoolDirectory.empty() && (protocol_ == Protocol::Pickle || transport_ == Transport::UDP))
+		{
+			METLOG(TLVL_WARNING) << "spool_directory is only supported with plaintext over TCP, metrics will not be spooled";
+		}
+		else if (!spoolDirectory.empty())
+		{
+			// Named for the application and plugin instance. A second process with the same names finds the prefix locked.
+			auto prefix = app_name_ + "_" + metric_name_ + "_";
+			std::replace(prefix.begin(), prefix.end(), '/', '_');
+			spool_ = std::make_unique<GraphiteSpool>(spoolDirectory, prefix, pset.get<size_t>("spool_max_size", 268435456),
+			                                         pset.get<size_t>("spool_segment_size", 16777216));
+			if (!spool_->Enabled())
+			{
+				spool_.reset();
+			}
+		}
+		thread_ = boost::thread([this] { runIOService_(); });
 		startMetrics();
 	}
 
 	/**
-	 * \brief GraphiteMetric Destructor. Calls stopMetrics()
+	 * \brief GraphiteMetric Destructor. Calls stopMetrics(), then waits up to connect_timeout for the queued batches to
+	 * be written, if connected, before stopping the I/O thread. If not connected, they are moved to the spool, if enabled.
 	 */
-	~GraphiteMetric() override { stopMetrics(); }
+	~GraphiteMetric() override
+	{
+		stopMetrics();
+		boost::asio::post(io_service_, [this] {
+			finished_ = true;
+			replayTimer_.cancel();
+			// A connection attempt in progress may still deliver the queued batches
+			if (!connected_ && (!connecting_ || backingOff_))
+			{
+				spill_();
+				timer_.cancel();
+				resolver_.cancel();
+				close_();
+			}
+		});
+		work_.reset();
+		std::unique_lock<std::mutex> lk(mutex_);
+		if (!stoppedCV_.wait_for(lk, connectTimeout_, [this] { return ioStopped_; }))
+		{
+			METLOG(TLVL_WARNING) << "Metrics for Graphite at " << host_ << ":" << port_ << " were not written within the connect timeout, dropping them";
+			io_service_.stop();
+		}
+		lk.unlock();
+		thread_.join();
+	}
 
 	/**
 	 * \brief Get the library name for the Graphite metric
@@ -90,24 +562,37 @@ public:
 	 */
 	void sendMetric_(const std::string& name, const std::string& value, const std::string& /*unit*/, const std::chrono::system_clock::time_point& time) override
 	{
-		if (!stopped_)
+		if (stopped_)
 		{
-			boost::asio::streambuf data;
-			auto nameTemp(name);
-			std::replace(nameTemp.begin(), nameTemp.end(), ' ', '_');
-			std::ostream out(&data);
-			out << namespace_ << nameTemp << " "
-			    << value << " "
-			    << std::chrono::system_clock::to_time_t(time) << std::endl;
+			return;
+		}
 
-			boost::system::error_code error;
-			boost::asio::write(socket_, data, error);
-			if (error)
+		auto path = namespace_ + name;
+		sanitize_(path);
+		if (protocol_ == Protocol::Pickle)
+		{
+			char* end = nullptr;
+			auto number = std::strtod(value.c_str(), &end);
+			auto last = end;
+			while (last != nullptr && std::isspace(static_cast<unsigned char>(*last))) ++last;
+			// The whole value must be a number, otherwise e.g. "12 events" would be sent as 12
+			if (end == value.c_str() || last != value.c_str() + value.size())
 			{
-				errorCount_++;
-				reconnect_();
+				METLOG(TLVL_DEBUG + 32) << "Not sending metric " << name << " with non-numeric value " << value << " using the pickle protocol";
+				return;
 			}
+			appendPickle_(path, number, std::chrono::system_clock::to_time_t(time));
 		}
+		else
+		{
+			batch_ += path;
+			batch_ += ' ';
+			batch_ += value;
+			batch_ += ' ';
+			appendInteger_(std::chrono::system_clock::to_time_t(time));
+			batch_ += '\n';
+		}
+		enqueue_();
 	}
 
 	/**
@@ -159,69 +644,746 @@ public:
 	}
 
 	/**
-	 * \brief Perform startup actions. For Graphite, this means reconnecting the socket.
+	 * \brief Send all values reported in an interval to Graphite, in writes of up to max_batch_size bytes
+	 * \param records The reported values
+	 * \param count The number of reported values
+	 */
+	void sendMetrics_(MetricRecord const* records, size_t count) override
+	{
+		if (stopped_ || count == 0)
+		{
+			return;
+		}
+
+		for (size_t ii = 0; ii < count; ++ii)
+		{
+			if (protocol_ == Protocol::Pickle)
+			{
+				appendPickle_(recordName_(records[ii].name_id), recordValue_(records[ii]), std::chrono::system_clock::to_time_t(records[ii].timestamp));
+				if (batch_.size() >= maxBatchSize_)
+				{
+					enqueue_();
+				}
+				continue;
+			}
+
+			batch_ += recordName_(records[ii].name_id);
+			batch_ += ' ';
+			switch (records[ii].type)
+			{
+				case MetricType::DoubleMetric:
+					appendDouble_(records[ii].value.d);
+					break;
+				case MetricType::FloatMetric:
+					appendDouble_(records[ii].value.f);
+					break;
+				case MetricType::IntMetric:
+					appendInteger_(records[ii].value.i);
+					break;
+				case MetricType::UnsignedMetric:
+					appendInteger_(records[ii].value.u);
+					break;
+				default:
+					break;
+			}
+			batch_ += ' ';
+			appendInteger_(std::chrono::system_clock::to_time_t(records[ii].timestamp));
+			batch_ += '\n';
+
+			if (batch_.size() >= maxBatchSize_)
+			{
+				enqueue_();
+			}
+		}
+		enqueue_();
+	}
+
+	/**
+	 * \brief Perform startup actions. For Graphite, this means connecting the socket, on the I/O thread.
 	 */
 	void startMetrics_() override
 	{
 		if (stopped_)
 		{
-			reconnect_();
 			stopped_ = false;
+			boost::asio::post(io_service_, [this] {
+				closing_ = false;
+				startConnect_();
+			});
 		}
 	}
 
 	/**
-	 * \brief Perform shutdown actions. This shuts down the socket and closes it.
+	 * \brief Perform shutdown actions. The socket is shut down and closed once the queued batches are written.
 	 */
 	void stopMetrics_() override
 	{
 		if (!stopped_)
 		{
-			try
+			enqueue_();
+			stopped_ = true;
+			boost::asio::post(io_service_, [this] {
+				closing_ = true;
+				startWrite_();
+			});
+		}
+	}
+
+private:
+	GraphiteMetric(const GraphiteMetric&) = delete;
+	GraphiteMetric(GraphiteMetric&&) = delete;
+	GraphiteMetric& operator=(const GraphiteMetric&) = delete;
+	GraphiteMetric& operator=(GraphiteMetric&&) = delete;
+
+	/**
+	 * \brief Parse the protocol parameter
+	 * \param protocol "plaintext" or "pickle"
+	 * \return The Protocol
+	 */
+	static Protocol protocolFromString_(std::string const& protocol)
+	{
+		if (protocol == "plaintext")
+		{
+			return Protocol::Plaintext;
+		}
+		if (protocol == "pickle")
+		{
+			return Protocol::Pickle;
+		}
+		throw cet::exception("Configuration Error")  // NOLINT(cert-err60-cpp)
+		    << "Unknown Graphite protocol \"" << protocol << "\", expected \"plaintext\" or \"pickle\"";
+	}
+
+	/**
+	 * \brief Parse the transport parameter
+	 * \param transport "tcp" or "udp"
+	 * \return The Transport
+	 */
+	static Transport transportFromString_(std::string const& transport)
+	{
+		if (transport == "tcp")
+		{
+			return Transport::TCP;
+		}
+		if (transport == "udp")
+		{
+			return Transport::UDP;
+		}
+		throw cet::exception("Configuration Error")  // NOLINT(cert-err60-cpp)
+		    << "Unknown Graphite transport \"" << transport << "\", expected \"tcp\" or \"udp\"";
+	}
+
+	/**
+	 * \brief Make a metric name usable as a Graphite path, by replacing the spaces which would end it in plaintext
+	 * \param path Namespace and metric name
+	 */
+	static void sanitize_(std::string& path) { std::replace(path.begin(), path.end(), ' ', '_'); }
+
+	/**
+	 * \brief Get the output name of a metric record: the namespace followed by the metric name, sanitized
+	 * \param name_id Name id of the record (see recordString)
+	 * \return The output name
+	 */
+	std::string const& recordName_(size_t name_id)
+	{
+		if (recordNames_.size() <= name_id)
+		{
+			recordNames_.resize(name_id + 1);
+		}
+		auto& name = recordNames_[name_id];
+		if (name.empty())
+		{
+			name = namespace_ + recordString(name_id);
+			sanitize_(name);
+		}
+		return name;
+	}
+
+	/**
+	 * \brief Append an integer to the batch
+	 * \param value Value to append
+	 */
+	template<typename T>
+	void appendInteger_(T value)
+	{
+		char text[24];
+		auto result = std::to_chars(text, text + sizeof(text), value);
+		batch_.append(text, result.ptr);
+	}
+
+	/**
+	 * \brief Append a floating-point value to the batch, formatted like std::to_string
+	 * \param value Value to append
+	 */
+	void appendDouble_(double value)
+	{
+		char text[512];  // Large enough for any double in %f format
+		auto length = std::snprintf(text, sizeof(text), "%f", value);
+		batch_.append(text, static_cast<size_t>(length));
+	}
+
+	/**
+	 * \brief Get the value of a metric record as a double, which is how Carbon stores all values
+	 * \param record Metric record
+	 * \return The value
+	 */
+	static double recordValue_(MetricRecord const& record)
+	{
+		switch (record.type)
+		{
+			case MetricType::DoubleMetric:
+				return record.value.d;
+			case MetricType::FloatMetric:
+				return record.value.f;
+			case MetricType::IntMetric:
+				return record.value.i;
+			case MetricType::UnsignedMetric:
+				return static_cast<double>(record.value.u);
+			default:
+				return 0.0;
+		}
+	}
+
+	/**
+	 * \brief Append a (path, (timestamp, value)) tuple to the pickle message in the batch, starting the message if the
+	 * batch is empty. Uses pickle protocol 2 opcodes, which Carbon's Python 2 and Python 3 receivers both accept.
+	 * \param path Sanitized Graphite path
+	 * \param value Value of the metric
+	 * \param time Timestamp of the metric
+	 */
+	void appendPickle_(std::string const& path, double value, time_t time)
+	{
+		if (batch_.empty())
+		{
+			// Message length (filled in by finishPickle_), PROTO 2, EMPTY_LIST, MARK
+			batch_.append(4, '\0');
+			batch_ += "\x80\x02](";
+		}
+
+		batch_ += 'X';  // BINUNICODE
+		appendLittleEndian_(static_cast<uint32_t>(path.size()));
+		batch_ += path;
+		if (time >= std::numeric_limits<int32_t>::min() && time <= std::numeric_limits<int32_t>::max())
+		{
+			batch_ += 'J';  // BININT
+			appendLittleEndian_(static_cast<uint32_t>(static_cast<int32_t>(time)));
+		}
+		else
+		{
+			appendBinFloat_(static_cast<double>(time));
+		}
+		appendBinFloat_(value);
+		batch_ += "\x86\x86";  // TUPLE2 (timestamp, value), TUPLE2 (path, (timestamp, value))
+	}
+
+	/**
+	 * \brief End the pickle message in the batch: APPENDS the tuples to the list, STOP, and fill in the length prefix
+	 */
+	void finishPickle_()
+	{
+		batch_ += "e.";
+		auto length = static_cast<uint32_t>(batch_.size() - 4);
+		for (int ii = 0; ii < 4; ++ii)
+		{
+			batch_[static_cast<size_t>(ii)] = static_cast<char>((length >> (8 * (3 - ii))) & 0xFF);  // Big-endian
+		}
+	}
+
+	/**
+	 * \brief Append a 4-byte little-endian integer to the batch, as used by the BININT and BINUNICODE pickle opcodes
+	 * \param value Value to append
+	 */
+	void appendLittleEndian_(uint32_t value)
+	{
+		for (int ii = 0; ii < 4; ++ii)
+		{
+			batch_ += static_cast<char>((value >> (8 * ii)) & 0xFF);
+		}
+	}
+
+	/**
+	 * \brief Append a BINFLOAT pickle opcode, followed by the value as a big-endian IEEE double
+	 * \param value Value to append
+	 */
+	void appendBinFloat_(double value)
+	{
+		uint64_t bits = 0;
+		std::memcpy(&bits, &value, sizeof(bits));
+		batch_ += 'G';
+		for (int ii = 7; ii >= 0; --ii)
+		{
+			batch_ += static_cast<char>((bits >> (8 * ii)) & 0xFF);
+		}
+	}
+
+	/**
+	 * \brief Queue the batch for the I/O thread, and start a new one in reused storage
+	 */
+	void enqueue_()
+	{
+		if (batch_.empty())
+		{
+			return;
+		}
+		if (protocol_ == Protocol::Pickle)
+		{
+			finishPickle_();
+		}
+
+		size_t dropped = 0;
+		{
+			std::lock_guard<std::mutex> lk(mutex_);
+			while (!pending_.empty() && pendingBytes_ + batch_.size() > maxQueuedBytes_)
+			{
+				pendingBytes_ -= pending_.front().size();
+				pending_.pop_front();
+				++dropped;
+			}
+			pendingBytes_ += batch_.size();
+			pending_.push_back(std::move(batch_));
+			batch_.clear();
+			if (!spare_.empty())
+			{
+				batch_.swap(spare_.back());
+				spare_.pop_back();
+			}
+		}
+		if (dropped > 0)
+		{
+			METLOG(TLVL_WARNING) << "Graphite at " << host_ << ":" << port_ << " is not keeping up, dropped " << dropped << " queued batches of metrics";
+		}
+		boost::asio::post(io_service_, [this] { startWrite_(); });
+	}
+
+	/**
+	 * \brief Run the I/O thread
+	 */
+	void runIOService_()
+	{
+		try
+		{
+			io_service_.run();
+		}
+		catch (std::exception const& ex)
+		{
+			METLOG(TLVL_ERROR) << "Graphite I/O thread for " << host_ << ":" << port_ << " stopped by exception: " << ex.what();
+		}
+		std::lock_guard<std::mutex> lk(mutex_);
+		ioStopped_ = true;
+		stoppedCV_.notify_all();
+	}
+
+	/**
+	 * \brief Write the next queued batch, or else the next lines from the spool, if connected and not already writing.
+	 * Runs on the I/O thread.
+	 */
+	void startWrite_()
+	{
+		if (inFlight_)
+		{
+			return;
+		}
+		if (!connected_)
+		{
+			// Once a connection attempt has failed, keep new batches in the spool rather than in memory
+			if (backingOff_)
+			{
+				spill_();
+			}
+			std::lock_guard<std::mutex> lk(mutex_);
+			if (!pending_.empty() || (!closing_ && spool_ && spool_->Size() > 0))
+			{
+				startConnect_();
+			}
+			return;
+		}
+		if (transport_ == Transport::UDP)
+		{
+			sendDatagrams_();
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(mutex_);
+			if (!pending_.empty())
+			{
+				writing_.swap(pending_.front());
+				pending_.pop_front();
+				pendingBytes_ -= writing_.size();
+			}
+		}
+		if (writing_.empty())
+		{
+			if (closing_)
+			{
+				close_();
+			}
+			else if (spool_)
+			{
+				replay_();
+			}
+			return;
+		}
+
+		inFlight_ = true;
+		boost::asio::async_write(socket_, boost::asio::buffer(writing_), [this](boost::system::error_code const& error, size_t /*bytes*/) {
+			inFlight_ = false;
+			if (error)
+			{
+				// The relay may or may not have received part of the batch. Graphite keeps one value for each name and
+				// timestamp, so writing it again from the spool is harmless.
+				METLOG(TLVL_WARNING) << "Error writing to Graphite at " << host_ << ":" << port_ << ": " << error.message();
+				spoolLines_(writing_.data(), writing_.size());
+			}
+			{
+				std::lock_guard<std::mutex> lk(mutex_);
+				writing_.clear();
+				if (spare_.size() < 4)
+				{
+					spare_.emplace_back();
+					spare_.back().swap(writing_);
+				}
+			}
+			if (error)
+			{
+				retry_();
+				return;
+			}
+			startWrite_();
+		});
+	}
+
+	/**
+	 * \brief Send the queued batches in datagrams of up to udp_mtu bytes, as many per system call as sendmmsg allows.
+	 * Datagrams which cannot be sent without waiting are dropped. Runs on the I/O thread.
+	 */
+	void sendDatagrams_()
+	{
+		while (true)
+		{
 			{
-				socket_.shutdown(boost::asio::socket_base::shutdown_send);
-				socket_.close();
-				stopped_ = true;
+				std::lock_guard<std::mutex> lk(mutex_);
+				if (pending_.empty())
+				{
+					break;
+				}
+				writing_.swap(pending_.front());
+				pending_.pop_front();
+				pendingBytes_ -= writing_.size();
 			}
-			catch (boost::system::system_error& err)
+
+			// Pack whole lines into each datagram. A line longer than udp_mtu is sent alone, unless it cannot fit in any datagram.
+			const size_t maxDatagram = 65507;
+			datagrams_.clear();
+			size_t start = 0;
+			while (start < writing_.size())
 			{
-				METLOG(TLVL_WARNING) << "In destructor of GraphiteMetric instance associated with " << host_ << ":" << port_ << ", the following boost::system::system_error exception was thrown out of a call to stopMetrics() and caught: " << err.code() << ", \"" << err.what() << "\"";
+				auto end = writing_.size();
+				if (end - start > mtu_)
+				{
+					auto last = writing_.rfind('\n', start + mtu_ - 1);
+					end = last != std::string::npos && last >= start ? last + 1 : writing_.find('\n', start + mtu_) + 1;
+					if (end == 0)
+					{
+						end = writing_.size();
+					}
+				}
+				if (end - start > maxDatagram)
+				{
+					METLOG(TLVL_WARNING) << "Dropping a " << end - start << " byte line which is too long for a UDP datagram to Graphite at " << host_ << ":" << port_;
+				}
+				else
+				{
+					datagrams_.push_back({&writing_[start], end - start});
+				}
+				start = end;
 			}
-			catch (...)
+			messages_.resize(datagrams_.size());
+			for (size_t ii = 0; ii < datagrams_.size(); ++ii)
+			{
+				messages_[ii] = {};
+				messages_[ii].msg_hdr.msg_iov = &datagrams_[ii];
+				messages_[ii].msg_hdr.msg_iovlen = 1;
+			}
+
+			size_t sent = 0;
+			int error = 0;
+			while (sent < messages_.size())
 			{
-				METLOG(TLVL_WARNING) << "In destructor of GraphiteMetric instance associated with " << host_ << ":" << port_ << ", an *unknown* exception was thrown out of a call to stopMetrics() and caught!";
+				auto count = static_cast<unsigned int>(std::min(messages_.size() - sent, size_t(UIO_MAXIOV)));
+				auto rc = ::sendmmsg(udpSocket_.native_handle(), &messages_[sent], count, MSG_DONTWAIT);
+				if (rc < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+					error = errno;
+					break;
+				}
+				sent += static_cast<size_t>(rc);
+			}
+
+			{
+				std::lock_guard<std::mutex> lk(mutex_);
+				writing_.clear();
+				if (spare_.size() < 4)
+				{
+					spare_.emplace_back();
+					spare_.back().swap(writing_);
+				}
+			}
+			if (error != 0)
+			{
+				METLOG(TLVL_WARNING) << "Error sending to Graphite at " << host_ << ":" << port_ << ", dropped " << messages_.size() - sent
+				                     << " of " << messages_.size() << " datagrams: " << std::strerror(error);
+				// A full socket buffer, a relay which is not listening (reported by ICMP), or a datagram the path cannot carry only loses these datagrams
+				if (error != EAGAIN && error != EWOULDBLOCK && error != ENOBUFS && error != ECONNREFUSED && error != EMSGSIZE)
+				{
+					retry_();
+					return;
+				}
 			}
 		}
+		if (closing_)
+		{
+			close_();
+		}
 	}
 
-private:
-	GraphiteMetric(const GraphiteMetric&) = delete;
-	GraphiteMetric(GraphiteMetric&&) = delete;
-	GraphiteMetric& operator=(const GraphiteMetric&) = delete;
-	GraphiteMetric& operator=(GraphiteMetric&&) = delete;
+	/**
+	 * \brief Write the next lines from the spool, once spool_replay_rate allows. The lines are written directly from
+	 * the spool file, so nothing may be added to the spool until the write completes. Runs on the I/O thread.
+	 */
+	void replay_()
+	{
+		if (std::chrono::steady_clock::now() < replayNext_)
+		{
+			if (!replayWaiting_)
+			{
+				replayWaiting_ = true;
+				replayTimer_.expires_at(replayNext_);
+				replayTimer_.async_wait([this](boost::system::error_code const& error) {
+					replayWaiting_ = false;
+					if (!error)
+					{
+						startWrite_();
+					}
+				});
+			}
+			return;
+		}
+
+		auto lines = spool_->Front(maxBatchSize_);
+		if (lines.second == 0)
+		{
+			return;
+		}
+		inFlight_ = true;
+		replaying_ = lines.second;
+		boost::asio::async_write(socket_, boost::asio::buffer(lines.first, lines.second), [this](boost::system::error_code const& error, size_t /*bytes*/) {
+			inFlight_ = false;
+			if (error)
+			{
+				// The lines stay in the spool, to be written again after reconnecting
+				METLOG(TLVL_WARNING) << "Error writing spooled metrics to Graphite at " << host_ << ":" << port_ << ": " << error.message();
+				retry_();
+				return;
+			}
+			spool_->Consume(replaying_);
+			if (replayRate_ > 0)
+			{
+				replayNext_ = std::chrono::steady_clock::now() + seconds_(static_cast<double>(replaying_) / replayRate_);
+			}
+			if (spool_->Size() == 0)
+			{
+				METLOG(TLVL_INFO) << "Wrote all spooled metrics to Graphite at " << host_ << ":" << port_;
+			}
+			startWrite_();
+		});
+	}
 
 	/**
-	 * \brief Reconnect to Graphite
+	 * \brief Move the queued batches to the spool, if enabled. Runs on the I/O thread.
 	 */
-	void reconnect_()
+	void spill_()
 	{
-		if (errorCount_ < 5)
+		if (!spool_)
 		{
-			boost::system::error_code error;
-			tcp::resolver resolver(io_service_);
-			tcp::resolver::query query(host_, std::to_string(port_));
-			boost::asio::connect(socket_, resolver.resolve(query), error);
-			if (!error) { errorCount_ = 0; }
-			else
+			return;
+		}
+		std::deque<std::string> batches;
+		{
+			std::lock_guard<std::mutex> lk(mutex_);
+			batches.swap(pending_);
+			pendingBytes_ = 0;
+		}
+		for (auto const& batch : batches)
+		{
+			spoolLines_(batch.data(), batch.size());
+		}
+		std::lock_guard<std::mutex> lk(mutex_);
+		for (auto& batch : batches)
+		{
+			if (spare_.size() >= 4)
 			{
-				METLOG(TLVL_WARNING) << "Error reconnecting socket, attempt #" << errorCount_;
+				break;
 			}
-			waitStart_ = std::chrono::steady_clock::now();
+			batch.clear();
+			spare_.push_back(std::move(batch));
 		}
-		else if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - waitStart_).count() >= 5)  // Seconds
+	}
+
+	/**
+	 * \brief Append lines to the spool, if enabled. Runs on the I/O thread.
+	 * \param data Complete lines
+	 * \param size Number of bytes
+	 */
+	void spoolLines_(char const* data, size_t size)
+	{
+		if (!spool_)
+		{
+			return;
+		}
+		auto dropped = spool_->Append(data, size);
+		if (dropped > 0)
+		{
+			METLOG(TLVL_WARNING) << "Graphite spool for " << host_ << ":" << port_ << " is full, dropped " << dropped << " bytes of metrics";
+		}
+	}
+
+	/**
+	 * \brief Resolve the host and connect, giving up after connect_timeout. Runs on the I/O thread.
+	 */
+	void startConnect_()
+	{
+		if (connected_ || connecting_ || finished_)
+		{
+			return;
+		}
+		connecting_ = true;
+		attempts_++;
+		resolver_.async_resolve(host_, std::to_string(port_), [this](boost::system::error_code const& error, tcp::resolver::results_type const& endpoints) {
+			if (error)
+			{
+				METLOG(TLVL_WARNING) << "Error resolving Graphite host " << host_ << ", attempt #" << attempts_ << ": " << error.message();
+				retry_();
+				return;
+			}
+
+			if (transport_ == Transport::UDP)
+			{
+				// Connecting a UDP socket only sets its destination, so that sendmmsg needs no addresses
+				boost::system::error_code connect_error;
+				for (auto const& entry : endpoints)
+				{
+					udpSocket_.close(connect_error);
+					udp::endpoint endpoint(entry.endpoint().address(), entry.endpoint().port());
+					udpSocket_.open(endpoint.protocol(), connect_error);
+					if (!connect_error)
+					{
+						udpSocket_.connect(endpoint, connect_error);
+					}
+					if (!connect_error)
+					{
+						break;
+					}
+				}
+				if (connect_error)
+				{
+					METLOG(TLVL_WARNING) << "Error opening UDP socket to Graphite at " << host_ << ":" << port_ << ", attempt #" << attempts_ << ": " << connect_error.message();
+					retry_();
+					return;
+				}
+				onConnected_();
+				return;
+			}
+
+			timer_.expires_after(connectTimeout_);
+			timer_.async_wait([this](boost::system::error_code const& timer_error) {
+				if (!timer_error && connecting_)
+				{
+					boost::system::error_code ignored;
+					socket_.close(ignored);  // Aborts the connection attempt
+				}
+			});
+			boost::asio::async_connect(socket_, endpoints, [this](boost::system::error_code const& connect_error, tcp::endpoint const& /*endpoint*/) {
+				timer_.cancel();
+				if (connect_error)
+				{
+					METLOG(TLVL_WARNING) << "Error connecting to Graphite at " << host_ << ":" << port_ << ", attempt #" << attempts_ << ": "
+					                     << (connect_error == boost::asio::error::operation_aborted ? "timed out" : connect_error.message());
+					retry_();
+					return;
+				}
+				onConnected_();
+			});
+		});
+	}
+
+	/**
+	 * \brief Record a successful connection, and start writing. Runs on the I/O thread.
+	 */
+	void onConnected_()
+	{
+		METLOG(TLVL_DEBUG + 32) << "Connected to Graphite at " << host_ << ":" << port_;
+		connecting_ = false;
+		connected_ = true;
+		attempts_ = 0;
+		backoff_ = minBackoff_;
+		startWrite_();
+	}
+
+	/**
+	 * \brief Close the socket and connect again after the backoff interval, which doubles up to reconnect_max_interval.
+	 * Runs on the I/O thread.
+	 */
+	void retry_()
+	{
+		boost::system::error_code ignored;
+		socket_.close(ignored);
+		udpSocket_.close(ignored);
+		connected_ = false;
+		spill_();
+		if (finished_)
 		{
-			errorCount_ = 0;
+			connecting_ = false;
+			return;
 		}
+		connecting_ = true;  // Until the backoff interval has passed
+		backingOff_ = true;
+		timer_.expires_after(backoff_);
+		backoff_ = std::min(backoff_ * 2, maxBackoff_);
+		timer_.async_wait([this](boost::system::error_code const& error) {
+			if (!error)
+			{
+				connecting_ = false;
+				backingOff_ = false;
+				startConnect_();
+			}
+		});
+	}
+
+	/**
+	 * \brief Shut down and close the socket. Runs on the I/O thread.
+	 */
+	void close_()
+	{
+		boost::system::error_code ignored;
+		socket_.shutdown(boost::asio::socket_base::shutdown_send, ignored);
+		socket_.close(ignored);
+		udpSocket_.close(ignored);
+		connected_ = false;
+	}
+
+	/**
+	 * \brief Convert a configured number of seconds to a steady_clock duration
+	 * \param seconds Number of seconds
+	 * \return The duration
+	 */
+	static std::chrono::steady_clock::duration seconds_(double seconds)
+	{
+		return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
 	}
 };
 }  // End namespace artdaq
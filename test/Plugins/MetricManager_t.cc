@@ -5,6 +5,9 @@
 #include "artdaq-utilities/Plugins/MetricManager.hh"
 #include "artdaq-utilities/Plugins/TestMetric.hh"
 
+#include <algorithm>
+#include <thread>
+
 #define BOOST_TEST_MODULE MetricManager_t
 #include "cetlib/quiet_unit_test.hpp"
 #include "cetlib_except/exception.h"
@@ -92,6 +95,44 @@ BOOST_AUTO_TEST_CASE(Initialize_WithError)
 	TLOG_DEBUG("MetricManager_t") << "END TEST Initialize_WithError" << TLOG_ENDL;
 }
 
+BOOST_AUTO_TEST_CASE(Initialize_WithWorkerError)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST Initialize_WithWorkerError" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	// The first plugin has a mistyped worker parameter, so it is not loaded; the second must still be driven correctly
+	std::string testConfig = "a_err: { level: 5 metricPluginType: test reporting_interval: 0.1 worker_queue_size: \"lots\"} b_good: { level: 5 metricPluginType: test reporting_interval: 0.1 send_zeros: false} metric_send_maximum_delay_ms: 100";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	TRACE_REQUIRE_EQUAL(mm.Initialized(), true);
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Active(), true);
+
+	mm.sendMetric("Worker Error Metric", 3, "Units", 1, artdaq::MetricMode::LastPoint, "", true);
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+	mm.do_stop();
+
+	int received = 0;
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "Worker Error Metric" && point.value == "3") received++;
+		}
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+	// The last value may be reported again when stopping
+	TRACE_REQUIRE_EQUAL(received > 0, true);
+
+	mm.shutdown();
+	TLOG_DEBUG("MetricManager_t") << "END TEST Initialize_WithWorkerError" << TLOG_ENDL;
+}
+
 BOOST_AUTO_TEST_CASE(Shutdown)
 {
 	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST Shutdown" << TLOG_ENDL;
@@ -312,6 +353,256 @@ BOOST_AUTO_TEST_CASE(SendMetrics)  // NOLINT(readability-function-size)
 	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics" << TLOG_ENDL;
 }
 
+BOOST_AUTO_TEST_CASE(SendMetrics_Handle)  // NOLINT(readability-function-size)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_Handle" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	auto handle = mm.registerMetric("Test Metric Handle", artdaq::MetricType::IntMetric, "Units", 2, artdaq::MetricMode::Accumulate, "", true);
+	auto stringHandle = mm.registerMetric("Test Metric String Handle", artdaq::MetricType::StringMetric, "Units", 2, artdaq::MetricMode::LastPoint, "", true);
+	BOOST_REQUIRE(handle.Valid());
+	BOOST_REQUIRE(stringHandle.Valid());
+	BOOST_REQUIRE(!artdaq::MetricHandle().Valid());
+	TRACE_REQUIRE_EQUAL(mm.metricQueueEmpty(), true);
+
+	std::string testConfig = "msgFac: { level: 5 metricPluginType: test reporting_interval: 0.5 send_zeros: false} metric_send_maximum_delay_ms: 100 metric_holdoff_us: 10000";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Running(), true);
+	TRACE_REQUIRE_EQUAL(mm.Active(), true);
+
+	mm.sendMetric(handle, 4);
+	mm.sendMetric(handle, 5);
+	mm.sendMetric(handle, 6.0);  // Wrong type, rejected
+	mm.sendMetric("Test Metric Handle", 6, "Units", 2, artdaq::MetricMode::Accumulate, "", true);
+	mm.sendMetric(stringHandle, std::string("First"));
+	mm.sendMetric(stringHandle, std::string("Second"));
+	mm.sendMetric(artdaq::MetricHandle(), 7);
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		int present = 0;
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "Test Metric Handle")
+			{
+				TRACE_REQUIRE_EQUAL(point.value, "15");
+				TRACE_REQUIRE_EQUAL(point.unit, "Units");
+				present++;
+			}
+			if (point.metric == "Test Metric String Handle")
+			{
+				TRACE_REQUIRE_EQUAL(point.value, "Second");
+				present++;
+			}
+		}
+		TRACE_REQUIRE_EQUAL(present, 2);
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+
+	mm.do_stop();
+	mm.shutdown();
+	TRACE_REQUIRE_EQUAL(mm.Initialized(), false);
+	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_Handle" << TLOG_ENDL;
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_Threads)  // NOLINT(readability-function-size)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_Threads" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	std::string testConfig = "msgFac: { level: 5 metricPluginType: test reporting_interval: 0.5 send_zeros: false} metric_send_maximum_delay_ms: 100 metric_holdoff_us: 10000 metric_queue_size: 100000";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Running(), true);
+	TRACE_REQUIRE_EQUAL(mm.Active(), true);
+
+	const int thread_count = 4;
+	const int points_per_thread = 1000;
+	std::vector<std::thread> threads;
+	for (int tt = 0; tt < thread_count; ++tt)
+	{
+		threads.emplace_back([&mm, tt]() {
+			for (int ii = 0; ii < points_per_thread; ++ii)
+			{
+				mm.sendMetric("Test Metric Threads", 1, "Units", 2, artdaq::MetricMode::Accumulate | artdaq::MetricMode::Maximum, "", true);
+				mm.sendMetric("Test Metric Threads", tt, "Units", 2, artdaq::MetricMode::Accumulate | artdaq::MetricMode::Maximum, "", true);
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		int total = 0;
+		int max = 0;
+		int present = 0;
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "Test Metric Threads - Total")
+			{
+				total += std::stoi(point.value);
+				present++;
+			}
+			if (point.metric == "Test Metric Threads - Max")
+			{
+				// Each reporting interval only sees the threads which were running during it
+				max = std::max(max, std::stoi(point.value));
+			}
+		}
+		BOOST_REQUIRE(present > 0);
+		TRACE_REQUIRE_EQUAL(max, thread_count - 1);
+		TRACE_REQUIRE_EQUAL(total, points_per_thread * (thread_count + thread_count * (thread_count - 1) / 2));
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+
+	mm.do_stop();
+	mm.shutdown();
+	TRACE_REQUIRE_EQUAL(mm.Initialized(), false);
+	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_Threads" << TLOG_ENDL;
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_WorkerThread)  // NOLINT(readability-function-size)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_WorkerThread" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	std::string testConfig = "msgFac: { level: 5 metricPluginType: test reporting_interval: 0.5 send_zeros: false use_worker_thread: true worker_queue_size: 10} metric_send_maximum_delay_ms: 100 metric_holdoff_us: 10000";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Running(), true);
+	TRACE_REQUIRE_EQUAL(mm.Active(), true);
+
+	mm.sendMetric("Test Metric Worker", 1, "Units", 2, artdaq::MetricMode::Accumulate, "", true);
+	mm.sendMetric("Test Metric Worker", 2, "Units", 2, artdaq::MetricMode::Accumulate, "", true);
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		int total = 0;
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "Test Metric Worker")
+			{
+				TRACE_REQUIRE_EQUAL(point.unit, "Units");
+				total += std::stoi(point.value);
+			}
+		}
+		TRACE_REQUIRE_EQUAL(total, 3);
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+
+	// Plugin statistics describe the previous send pass, so wait for a few more passes
+	usleep(300000);
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		bool send_time = false;
+		bool queue_depth = false;
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "MetricManager_t.Metric Plugin msgFac Send Time - Average") send_time = true;
+			if (point.metric == "MetricManager_t.Metric Plugin msgFac Queue Depth") queue_depth = true;
+		}
+		TRACE_REQUIRE_EQUAL(send_time, true);
+		TRACE_REQUIRE_EQUAL(queue_depth, true);
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+
+	mm.do_stop();
+	mm.shutdown();
+	TRACE_REQUIRE_EQUAL(mm.Initialized(), false);
+	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_WorkerThread" << TLOG_ENDL;
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_Overflow)  // NOLINT(readability-function-size)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_Overflow" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	std::string testConfig = "msgFac: { level: 5 metricPluginType: test reporting_interval: 0.5 send_zeros: false} metric_send_maximum_delay_ms: 100 metric_holdoff_us: 10000 metric_queue_size: 10 numeric_overflow_policy: drop string_overflow_policy: reservoir";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Running(), true);
+	TRACE_REQUIRE_EQUAL(mm.Active(), true);
+
+	const int point_count = 100;
+	for (int ii = 0; ii < point_count; ++ii)
+	{
+		mm.sendMetric("Test Metric Overflow", 1, "Units", 2, artdaq::MetricMode::Accumulate, "", true);
+		mm.sendMetric("Test Metric Reservoir", std::to_string(ii), "Units", 2, artdaq::MetricMode::Accumulate, "", true);
+	}
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		int total = 0;
+		int dropped = 0;
+		int samples = 0;
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "Test Metric Overflow")
+			{
+				total += std::stoi(point.value);
+			}
+			if (point.metric == "Test Metric Overflow Dropped Points")
+			{
+				dropped += std::stoi(point.value);
+			}
+			if (point.metric == "Test Metric Reservoir")
+			{
+				// Each interval keeps at most metric_queue_size of the values it received
+				auto count = std::count(point.value.begin(), point.value.end(), ' ') + 1;
+				BOOST_REQUIRE(count <= 10);
+				samples += count;
+			}
+		}
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+		BOOST_REQUIRE(dropped > 0);
+		TRACE_REQUIRE_EQUAL(total + dropped, point_count);
+		BOOST_REQUIRE(samples > 0);
+	}
+
+	mm.do_stop();
+	mm.shutdown();
+	TRACE_REQUIRE_EQUAL(mm.Initialized(), false);
+	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_Overflow" << TLOG_ENDL;
+}
+
 BOOST_AUTO_TEST_CASE(SendMetrics_Levels)  // NOLINT(readability-function-size)
 {
 	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_Levels" << TLOG_ENDL;
@@ -329,11 +620,19 @@ BOOST_AUTO_TEST_CASE(SendMetrics_Levels)  // NOLINT(readability-function-size)
 	TRACE_REQUIRE_EQUAL(mm.Initialized(), true);
 	TRACE_REQUIRE_EQUAL(mm.Running(), false);
 	TRACE_REQUIRE_EQUAL(mm.Active(), false);
+	TRACE_REQUIRE_EQUAL(mm.IsLevelEnabled(5), true);
+	TRACE_REQUIRE_EQUAL(mm.IsLevelEnabled(6), false);
+	TRACE_REQUIRE_EQUAL(mm.IsLevelEnabled(9), true);
+	TRACE_REQUIRE_EQUAL(mm.IsLevelEnabled(64), false);
 
 	mm.do_start();
 	TRACE_REQUIRE_EQUAL(mm.Running(), true);
 	TRACE_REQUIRE_EQUAL(mm.Active(), true);
 
+	// Levels which no plugin accepts are discarded before reaching the metric queue
+	mm.sendMetric("Rejected Metric", 6, "Units", 6, artdaq::MetricMode::LastPoint, "", true);
+	TRACE_REQUIRE_EQUAL(mm.metricQueueSize(), 0);
+
 	mm.sendMetric("Test Metric 0", 0, "Units", 0, artdaq::MetricMode::LastPoint, "", true);
 	mm.sendMetric("Test Metric 1", 1, "Units", 1, artdaq::MetricMode::LastPoint, "", true);
 	mm.sendMetric("Test Metric 2", 2, "Units", 2, artdaq::MetricMode::LastPoint, "", true);
@@ -434,6 +733,129 @@ BOOST_AUTO_TEST_CASE(SendMetrics_Levels)  // NOLINT(readability-function-size)
 	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_Levels" << TLOG_ENDL;
 }
 
+BOOST_AUTO_TEST_CASE(SendMetrics_CompileTimeLevels)  // NOLINT(readability-function-size)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_CompileTimeLevels" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	std::string testConfig = "msgFac: { metric_levels: [ 3, 7, 9 ] metricPluginType: test reporting_interval: 0.1 send_zeros: false} metric_send_maximum_delay_ms: 100";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Active(), true);
+
+	// Values are only computed for levels which are compiled in (up to ARTDAQ_METRIC_MAX_LEVEL) and enabled at run time
+	int evaluations = 0;
+	auto evaluate = [&evaluations](int value) {
+		evaluations++;
+		return value;
+	};
+	ARTDAQ_SEND_METRIC(mm, 3, "Compiled Metric 3", evaluate(3), "Units", artdaq::MetricMode::LastPoint, "", true);
+	ARTDAQ_SEND_METRIC(mm, 5, "Compiled Metric 5", evaluate(5), "Units", artdaq::MetricMode::LastPoint, "", true);
+	ARTDAQ_SEND_METRIC(mm, 7, "Compiled Metric 7", evaluate(7), "Units", artdaq::MetricMode::LastPoint, "", true);
+	TRACE_REQUIRE_EQUAL(evaluations, (3 <= ARTDAQ_METRIC_MAX_LEVEL ? 1 : 0) + (7 <= ARTDAQ_METRIC_MAX_LEVEL ? 1 : 0));
+	mm.sendMetric<8>("Compiled Metric 8", 8, "Units", artdaq::MetricMode::LastPoint, "", true);
+	mm.sendMetric<9>("Compiled Metric 9", 9, "Units", artdaq::MetricMode::LastPoint, "", true);
+
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	std::bitset<10> received_metrics_;
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			for (int level : {3, 5, 7, 8, 9})
+			{
+				if (point.metric == "Compiled Metric " + std::to_string(level))
+				{
+					TRACE_REQUIRE_EQUAL(point.value, std::to_string(level));
+					received_metrics_[level] = true;
+				}
+			}
+		}
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+	std::bitset<10> expected_metrics_;
+	expected_metrics_[3] = 3 <= ARTDAQ_METRIC_MAX_LEVEL;
+	expected_metrics_[7] = 7 <= ARTDAQ_METRIC_MAX_LEVEL;
+	expected_metrics_[9] = 9 <= ARTDAQ_METRIC_MAX_LEVEL;
+	TRACE_REQUIRE_EQUAL(received_metrics_.to_ulong(), expected_metrics_.to_ulong());
+
+	mm.do_stop();
+	mm.shutdown();
+	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_CompileTimeLevels" << TLOG_ENDL;
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_SharedAggregate)  // NOLINT(readability-function-size)
+{
+	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST SendMetrics_SharedAggregate" << TLOG_ENDL;
+	artdaq::MetricManager mm;
+
+	// Both plugins have the same reporting interval, so they share one aggregate but report at their own levels
+	std::string testConfig = "high: { level: 5 metricPluginType: test reporting_interval: 0.1 send_zeros: false} low: { level: 1 metricPluginType: test reporting_interval: 0.1 send_zeros: false} metric_send_maximum_delay_ms: 100";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+
+	mm.initialize(pset, "MetricManager_t");
+	mm.do_start();
+	TRACE_REQUIRE_EQUAL(mm.Running(), true);
+
+	mm.sendMetric("Shared Metric 1", 1, "Units", 1, artdaq::MetricMode::Accumulate, "", true);
+	mm.sendMetric("Shared Metric 1", 2, "Units", 1, artdaq::MetricMode::Accumulate, "", true);
+	mm.sendMetric("Shared Metric 5", 5, "Units", 5, artdaq::MetricMode::Accumulate, "", true);
+	mm.sendMetric("Shared String 1", "both", "Units", 1, artdaq::MetricMode::LastPoint, "", true);
+	mm.sendMetric("Shared String 5", "high only", "Units", 5, artdaq::MetricMode::LastPoint, "", true);
+	while (mm.metricManagerBusy())
+	{
+		usleep(1000);
+	}
+
+	int total_1 = 0;
+	int received_1 = 0;
+	int received_5 = 0;
+	int received_string_1 = 0;
+	int received_string_5 = 0;
+	{
+		artdaq::TestMetric::LockReceivedMetricMutex();
+		for (auto& point : artdaq::TestMetric::received_metrics)
+		{
+			if (point.metric == "Shared Metric 1")
+			{
+				total_1 += std::stoi(point.value);
+				received_1++;
+			}
+			if (point.metric == "Shared Metric 5")
+			{
+				received_5++;
+			}
+			if (point.metric == "Shared String 1" && point.value == "both")
+			{
+				received_string_1++;
+			}
+			if (point.metric == "Shared String 5" && point.value == "high only")
+			{
+				received_string_5++;
+			}
+		}
+		artdaq::TestMetric::received_metrics.clear();
+		artdaq::TestMetric::UnlockReceivedMetricMutex();
+	}
+	TRACE_REQUIRE_EQUAL(received_1 % 2, 0);
+	TRACE_REQUIRE_EQUAL(total_1, 6);
+	TRACE_REQUIRE_EQUAL(received_5, 1);
+	// String metrics are not aggregated: each plugin sends them, if enabled at its own level
+	TRACE_REQUIRE_EQUAL(received_string_1, 2);
+	TRACE_REQUIRE_EQUAL(received_string_5, 1);
+
+	mm.do_stop();
+	mm.shutdown();
+	TLOG_DEBUG("MetricManager_t") << "END TEST SendMetrics_SharedAggregate" << TLOG_ENDL;
+}
+
 BOOST_AUTO_TEST_CASE(MetricFlood)  // NOLINT(readability-function-size)
 {
 	TLOG_DEBUG("MetricManager_t") << "BEGIN TEST MetricFlood" << TLOG_ENDL;
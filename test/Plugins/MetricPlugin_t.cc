@@ -7,6 +7,8 @@
 
 #include "TRACE/trace.h"
 
+#include <map>
+
 namespace artdaqtest {
 /// <summary>
 /// Metric plugin which stores metric call counts for testing
@@ -21,26 +23,43 @@ public:
 	explicit MetricPluginTestAdapter(fhicl::ParameterSet ps)
 	    : artdaq::MetricPlugin(ps, "MetricPlugin_t", "plugin_t")
 	    , sendMetric_string_calls(0)
+	    , sendMetric_string_batches(0)
 	    , sendMetric_int_calls(0)
+	    , sendMetric_int_total(0)
 	    , sendMetric_double_calls(0)
 	    , sendMetric_float_calls(0)
 	    , sendMetric_unsigned_calls(0)
+	    , sendMetrics_calls(0)
+	    , sendMetrics_records(0)
 	    , startMetrics_calls(0)
 	    , stopMetrics_calls(0)
 	{}
 
 	/**
-	 * \brief Send a String metric, record the call and discard the metric's data
+	 * \brief Send a String metric, record the call and the metric's value
 	 */
-	virtual void sendMetric_(const std::string&, const std::string&, const std::string&, const std::chrono::system_clock ::time_point&) override { sendMetric_string_calls++; }
+	virtual void sendMetric_(const std::string& name, const std::string& value, const std::string&, const std::chrono::system_clock ::time_point&) override
+	{
+		sendMetric_string_calls++;
+		sendMetric_string_values[name] = value;
+		sendMetric_string_batches = sendMetrics_calls;
+	}
 	/**
 	 * \brief Send an int metric, record the call and discard the metric's data
 	 */
-	virtual void sendMetric_(const std::string&, const int&, const std::string&, const std::chrono::system_clock ::time_point&) override { sendMetric_int_calls++; }
+	virtual void sendMetric_(const std::string&, const int& value, const std::string&, const std::chrono::system_clock ::time_point&) override
+	{
+		sendMetric_int_calls++;
+		sendMetric_int_total += value;
+	}
 	/**
-	 * \brief Send a double metric, record the call and discard the metric's data
+	 * \brief Send a double metric, record the call and the metric's value
 	 */
-	virtual void sendMetric_(const std::string&, const double&, const std::string&, const std::chrono::system_clock ::time_point&) override { sendMetric_double_calls++; }
+	virtual void sendMetric_(const std::string& name, const double& value, const std::string&, const std::chrono::system_clock ::time_point&) override
+	{
+		sendMetric_double_calls++;
+		sendMetric_double_values[name] = value;
+	}
 	/**
 	 * \brief Send a float metric, record the call and discard the metric's data
 	 */
@@ -49,6 +68,15 @@ public:
 	 * \brief Send an unsigned metric, record the call and discard the metric's data
 	 */
 	virtual void sendMetric_(const std::string&, const uint64_t&, const std::string&, const std::chrono::system_clock ::time_point&) override { sendMetric_unsigned_calls++; }
+	/**
+	 * \brief Send a batch of metric values, record the call and pass the values on to sendMetric_
+	 */
+	void sendMetrics_(MetricRecord const* records, size_t count) override
+	{
+		sendMetrics_calls++;
+		sendMetrics_records += count;
+		artdaq::MetricPlugin::sendMetrics_(records, count);
+	}
 
 	/**
 	 * \brief Record that a startMetrics call was received
@@ -60,10 +88,16 @@ public:
 	void stopMetrics_() override { stopMetrics_calls++; }
 
 	size_t sendMetric_string_calls;    ///< The number of string metric calls received
+	size_t sendMetric_string_batches;  ///< The number of sendMetrics_ batches received before the last string metric
+	std::map<std::string, std::string> sendMetric_string_values;  ///< The last string value received for each metric name
 	size_t sendMetric_int_calls;       ///< The number of int metric calls received
+	int sendMetric_int_total;          ///< The sum of the int metric values received
 	size_t sendMetric_double_calls;    ///< The number of double metric calls received
+	std::map<std::string, double> sendMetric_double_values;  ///< The last double value received for each metric name
 	size_t sendMetric_float_calls;     ///< The number of float metric calls received
 	size_t sendMetric_unsigned_calls;  ///< The numberof unsigned metric calls received
+	size_t sendMetrics_calls;          ///< The number of sendMetrics_ batches received
+	size_t sendMetrics_records;        ///< The number of metric values received in sendMetrics_ batches
 	size_t startMetrics_calls;         ///< The number of startMetrics_ calls received
 	size_t stopMetrics_calls;          ///< The number of stopMetrics_ calls received
 
@@ -184,6 +218,73 @@ BOOST_AUTO_TEST_CASE(AddMetricData)
 	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case AddMetricData END";
 }
 
+BOOST_AUTO_TEST_CASE(MetricAccumulator)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case MetricAccumulator BEGIN";
+	BOOST_REQUIRE_EQUAL(sizeof(artdaq::MetricAccumulator), 64);
+
+	artdaq::MetricData expected("Double Metric", 0.0, "Units", 1, artdaq::MetricMode::Accumulate | artdaq::MetricMode::Minimum | artdaq::MetricMode::Maximum, "", false);
+	expected.Reset();
+	auto merged = expected;
+	BOOST_REQUIRE(artdaq::MetricAccumulator::Supports(expected));
+	BOOST_REQUIRE(!artdaq::MetricAccumulator::Supports(artdaq::MetricData("String Metric", "", "Units", 1, artdaq::MetricMode::LastPoint, "", false)));
+	BOOST_REQUIRE(!artdaq::MetricAccumulator::Supports(artdaq::MetricData("Histogram Metric", 0.0, "Units", 1, artdaq::MetricMode::Histogram, "", false)));
+
+	artdaq::MetricAccumulator first;
+	artdaq::MetricAccumulator second;
+	first.Reset(artdaq::MetricType::DoubleMetric);
+	second.Reset(artdaq::MetricType::DoubleMetric);
+	for (auto value : {2.5, -1.0, 4.0})
+	{
+		first.AddPoint(value);
+		expected.AddPoint(value);
+	}
+	for (auto value : {8.0, 0.5})
+	{
+		second.AddPoint(value);
+		expected.AddPoint(value);
+	}
+	first.AddTo(merged);
+	second.AddTo(merged);
+
+	BOOST_REQUIRE_EQUAL(merged.DataPointCount, 5);
+	BOOST_REQUIRE_EQUAL(merged.Value.d, expected.Value.d);
+	BOOST_REQUIRE_EQUAL(merged.Last.d, 0.5);
+	BOOST_REQUIRE_EQUAL(merged.Min.d, -1.0);
+	BOOST_REQUIRE_EQUAL(merged.Max.d, 8.0);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case MetricAccumulator END";
+}
+
+BOOST_AUTO_TEST_CASE(MetricDataPool)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case MetricDataPool BEGIN";
+	artdaq::MetricDataPool pool;
+	pool.Add("Histogram Metric", 2.5, "Units", 1, artdaq::MetricMode::Histogram, "", false);
+	pool.Add("Int Metric", 3, "Units", 2, artdaq::MetricMode::Accumulate, "Prefix", false).Name += " Suffix";
+	BOOST_REQUIRE_EQUAL(pool.Size(), 2);
+	auto first = pool.begin();
+	BOOST_REQUIRE_EQUAL(first[1].Name, "Int Metric Suffix");
+	BOOST_REQUIRE_EQUAL(first[1].MetricPrefix, "Prefix");
+	BOOST_REQUIRE_EQUAL(first[1].Value.i, 3);
+
+	pool.Clear();
+	BOOST_REQUIRE_EQUAL(pool.Size(), 0);
+	BOOST_REQUIRE(pool.begin() == pool.end());
+
+	// Entries are reused in place, and keep nothing from their previous use
+	auto& reused = pool.Add("Unsigned Metric", 5UL, "Units", 3, artdaq::MetricMode::LastPoint, "", true);
+	BOOST_REQUIRE_EQUAL(&reused, first);
+	BOOST_REQUIRE(reused.Type == artdaq::MetricType::UnsignedMetric);
+	BOOST_REQUIRE(reused.HistogramBuckets.empty());
+	BOOST_REQUIRE_EQUAL(reused.DataPointCount, 1);
+	BOOST_REQUIRE_EQUAL(reused.Value.u, 5);
+	BOOST_REQUIRE_EQUAL(reused.Level, 3);
+	BOOST_REQUIRE(reused.UseNameOverride);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case MetricDataPool END";
+}
+
 BOOST_AUTO_TEST_CASE(SendMetrics)
 {
 	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics BEGIN";
@@ -216,6 +317,8 @@ BOOST_AUTO_TEST_CASE(SendMetrics)
 	BOOST_REQUIRE_EQUAL(mpta.sendMetric_float_calls, 1);
 	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 1);
 	BOOST_REQUIRE_EQUAL(mpta.sendMetric_unsigned_calls, 1);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetrics_calls, 1);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetrics_records, 4);
 
 	mpta.addMetricData(smd);
 	mpta.addMetricData(imd);
@@ -246,10 +349,242 @@ BOOST_AUTO_TEST_CASE(SendMetrics)
 	BOOST_REQUIRE_EQUAL(mpta.sendMetric_float_calls, 2);
 	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 2);
 	BOOST_REQUIRE_EQUAL(mpta.sendMetric_unsigned_calls, 2);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetrics_calls, 2);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetrics_records, 8);
 
 	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics END";
 }
 
+BOOST_AUTO_TEST_CASE(SendMetrics_ManyMetrics)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_ManyMetrics BEGIN";
+	std::string testConfig = "reporting_interval: 0.01 level: 4";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+	artdaqtest::MetricPluginTestAdapter mpta(pset);
+
+	const int metric_count = 100;
+	int expected_total = 0;
+	for (int ii = 0; ii < metric_count; ++ii)
+	{
+		mpta.addMetricData(artdaq::MetricData("Metric " + std::to_string(ii), ii, "Units", 1, artdaq::MetricMode::Accumulate, "", false));
+		mpta.addMetricData(artdaq::MetricData("Metric " + std::to_string(ii), 1, "Units", 1, artdaq::MetricMode::Accumulate, "", false));
+		expected_total += ii + 1;
+	}
+	BOOST_REQUIRE(mpta.metricsPending());
+
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_calls, metric_count);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_total, expected_total);
+	BOOST_REQUIRE(!mpta.metricsPending());
+
+	// Persisted values are reported again until new values arrive
+	mpta.addMetricData(artdaq::MetricData("Persisted Metric", 7, "Units", 1, artdaq::MetricMode::LastPoint | artdaq::MetricMode::Persist, "", false));
+	mpta.sendMetrics(true);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_total, expected_total + 7);
+	mpta.sendMetrics(true);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_total, expected_total + 14);
+	mpta.addMetricData(artdaq::MetricData("Persisted Metric", 9, "Units", 1, artdaq::MetricMode::LastPoint | artdaq::MetricMode::Persist, "", false));
+	mpta.sendMetrics(true);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_total, expected_total + 23);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_ManyMetrics END";
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_Schedule)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_Schedule BEGIN";
+	std::string testConfig = "reporting_interval: 0.5 level: 4";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+	artdaqtest::MetricPluginTestAdapter mpta(pset);
+
+	mpta.addMetricData(artdaq::MetricData("First Metric", 1, "Units", 1, artdaq::MetricMode::LastPoint, "", false));
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_calls, 1);
+
+	// Only the new metric is due, the first one waits for its reporting interval
+	mpta.addMetricData(artdaq::MetricData("Second Metric", 2, "Units", 1, artdaq::MetricMode::LastPoint, "", false));
+	mpta.addMetricData(artdaq::MetricData("First Metric", 3, "Units", 1, artdaq::MetricMode::LastPoint, "", false));
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_calls, 2);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_total, 3);
+	BOOST_REQUIRE(mpta.nextSendTime() > std::chrono::steady_clock::now());
+
+	usleep(600000);
+	BOOST_REQUIRE(mpta.nextSendTime() <= std::chrono::steady_clock::now());
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_calls, 4);  // Second Metric reports a zero
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_int_total, 6);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_Schedule END";
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_Histogram)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_Histogram BEGIN";
+	std::string testConfig = "reporting_interval: 0 level: 4 percentiles: [50, 99]";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+	artdaqtest::MetricPluginTestAdapter mpta(pset);
+
+	artdaq::MetricData hmd("Histogram Metric", artdaq::MetricType::DoubleMetric, "s", 1, artdaq::MetricMode::Histogram, "", false);
+	for (int ii = 1; ii <= 1000; ++ii)
+	{
+		hmd.AddPoint(ii / 1000.0);
+	}
+	BOOST_REQUIRE_CLOSE(hmd.HistogramPercentile(50), 0.5, 100.0 / artdaq::MetricHistogram::SubBuckets);
+	BOOST_REQUIRE_CLOSE(hmd.HistogramPercentile(99), 0.99, 100.0 / artdaq::MetricHistogram::SubBuckets);
+	BOOST_REQUIRE_EQUAL(hmd.HistogramPercentile(100), 1.0);
+
+	artdaq::MetricData merged(hmd);
+	merged.Add(hmd);
+	BOOST_REQUIRE_EQUAL(merged.DataPointCount, 2000);
+	BOOST_REQUIRE_EQUAL(merged.HistogramPercentile(50), hmd.HistogramPercentile(50));
+
+	mpta.addMetricData(hmd);
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 2);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_Histogram END";
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_Quantiles)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_Quantiles BEGIN";
+	std::string testConfig = "reporting_interval: 0 level: 4 percentiles: [50, 99]";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+	artdaqtest::MetricPluginTestAdapter mpta(pset);
+
+	// BOOST_REQUIRE_CLOSE checks relative difference against both values, so allow slightly more than the sketch accuracy
+	const double tolerance = 150.0 * artdaq::QuantileSketch::DefaultRelativeAccuracy;
+	artdaq::MetricData low("Quantile Metric", artdaq::MetricType::DoubleMetric, "s", 1, artdaq::MetricMode::Quantiles, "", false);
+	artdaq::MetricData high(low);
+	for (int ii = 1; ii <= 1000; ++ii)
+	{
+		low.AddPoint(ii / 1000.0);
+		high.AddPoint(1.0 + ii / 1000.0);
+	}
+	BOOST_REQUIRE_CLOSE(low.SketchPercentile(50), 0.5, tolerance);
+	BOOST_REQUIRE_CLOSE(low.SketchPercentile(99), 0.99, tolerance);
+
+	// Merging must give the percentiles of the combined population
+	BOOST_REQUIRE(low.Add(high));
+	BOOST_REQUIRE_EQUAL(low.Sketch.Count(), 2000);
+	BOOST_REQUIRE_CLOSE(low.SketchPercentile(50), 1.0, tolerance);
+	BOOST_REQUIRE_CLOSE(low.SketchPercentile(99), 1.98, tolerance);
+
+	artdaq::QuantileSketch restored;
+	BOOST_REQUIRE(artdaq::QuantileSketch::Deserialize(low.Sketch.Serialize(), restored));
+	BOOST_REQUIRE_EQUAL(restored.Count(), low.Sketch.Count());
+	BOOST_REQUIRE_EQUAL(restored.Quantile(0.5), low.Sketch.Quantile(0.5));
+	BOOST_REQUIRE(!artdaq::QuantileSketch::Deserialize("not a sketch", restored));
+
+	mpta.addMetricData(low);
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 2);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_string_calls, 0);
+
+	// With report_sketches, each interval's sketch is also sent, so that sketches from many processes can be merged
+	fhicl::ParameterSet sketchPset = fhicl::ParameterSet::make(testConfig + " report_sketches: true");
+	artdaqtest::MetricPluginTestAdapter first(sketchPset);
+	artdaqtest::MetricPluginTestAdapter second(sketchPset);
+	first.addMetricData(low);
+	first.sendMetrics();
+	second.addMetricData(high);
+	second.sendMetrics();
+	BOOST_REQUIRE_EQUAL(first.sendMetric_double_calls, 2);
+	BOOST_REQUIRE_EQUAL(first.sendMetric_string_calls, 1);
+	BOOST_REQUIRE_EQUAL(first.sendMetric_string_batches, 1);  // After the percentiles it was reported with
+
+	artdaq::QuantileSketch combined;
+	BOOST_REQUIRE(artdaq::QuantileSketch::DeserializeText(first.sendMetric_string_values["Quantile Metric - Sketch"], combined));
+	BOOST_REQUIRE(artdaq::QuantileSketch::DeserializeText(second.sendMetric_string_values["Quantile Metric - Sketch"], restored));
+	BOOST_REQUIRE(combined.Merge(restored));
+	BOOST_REQUIRE_EQUAL(combined.Count(), 3000);
+	BOOST_REQUIRE_CLOSE(combined.Quantile(0.5), 1.25, tolerance);
+	BOOST_REQUIRE(!artdaq::QuantileSketch::DeserializeText("not a sketch", restored));
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_Quantiles END";
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_StdDev)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_StdDev BEGIN";
+	std::string testConfig = "reporting_interval: 0 level: 4";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+	artdaqtest::MetricPluginTestAdapter mpta(pset);
+
+	// Large offset, small spread: a sum-of-squares formula loses all precision here
+	const double offset = 1e9;
+	artdaq::MetricData first("Jitter Metric", artdaq::MetricType::DoubleMetric, "s", 1, artdaq::MetricMode::StdDev | artdaq::MetricMode::Variance, "", false);
+	artdaq::MetricData second(first);
+	artdaq::MetricData all(first);
+	for (auto value : {4.0, 7.0, 13.0, 16.0})
+	{
+		first.AddPoint(offset + value);
+		all.AddPoint(offset + value);
+	}
+	for (auto value : {2.0, 8.0})
+	{
+		second.AddPoint(offset + value);
+		all.AddPoint(offset + value);
+	}
+	// Values 2, 4, 7, 8, 13, 16: mean 25/3, population variance 212/9
+	BOOST_REQUIRE_CLOSE(all.Variance(), 212.0 / 9.0, 1e-4);
+	BOOST_REQUIRE_CLOSE(first.Variance(), 22.5, 1e-4);
+
+	// Merging must give the moments of the combined population
+	BOOST_REQUIRE(first.Add(second));
+	BOOST_REQUIRE_EQUAL(first.DataPointCount, 6);
+	BOOST_REQUIRE_CLOSE(first.Mean, all.Mean, 1e-9);
+	BOOST_REQUIRE_CLOSE(first.Variance(), all.Variance(), 1e-4);
+	BOOST_REQUIRE_CLOSE(first.StdDev(), std::sqrt(212.0 / 9.0), 1e-4);
+
+	artdaq::MetricData empty("Jitter Metric", artdaq::MetricType::DoubleMetric, "s", 1, artdaq::MetricMode::StdDev, "", false);
+	BOOST_REQUIRE_EQUAL(empty.StdDev(), 0.0);
+	BOOST_REQUIRE(empty.Add(first));
+	BOOST_REQUIRE_EQUAL(empty.Variance(), first.Variance());
+
+	mpta.addMetricData(first);
+	mpta.sendMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 2);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_StdDev END";
+}
+
+BOOST_AUTO_TEST_CASE(SendMetrics_SmoothedRate)
+{
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_SmoothedRate BEGIN";
+	std::string testConfig = "reporting_interval: 0 level: 4";
+	fhicl::ParameterSet pset = fhicl::ParameterSet::make(testConfig);
+	artdaqtest::MetricPluginTestAdapter mpta(pset);
+
+	// The first interval has no known start, so it only starts the averages' interval
+	auto start = std::chrono::steady_clock::now();
+	mpta.addMetricData(artdaq::MetricData("Smoothed Metric", 5.0, "Units", 1, artdaq::MetricMode::SmoothedRate, "", false));
+	mpta.sendMetrics(false, start);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 3);
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_values["Smoothed Metric - Rate 1m"], 0.0);
+
+	// The first measured rate starts all averages
+	mpta.addMetricData(artdaq::MetricData("Smoothed Metric", 10.0, "Units", 1, artdaq::MetricMode::SmoothedRate, "", false));
+	mpta.sendMetrics(false, start + std::chrono::seconds(1));
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 6);
+	BOOST_REQUIRE_CLOSE(mpta.sendMetric_double_values["Smoothed Metric - Rate 1m"], 10.0, 1e-9);
+	BOOST_REQUIRE_CLOSE(mpta.sendMetric_double_values["Smoothed Metric - Rate 15m"], 10.0, 1e-9);
+
+	// An interval without values decays each average according to its window
+	mpta.sendMetrics(false, start + std::chrono::seconds(61));
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_calls, 9);
+	BOOST_REQUIRE_CLOSE(mpta.sendMetric_double_values["Smoothed Metric - Rate 1m"], 10.0 * std::exp(-1.0), 1e-6);
+	BOOST_REQUIRE_CLOSE(mpta.sendMetric_double_values["Smoothed Metric - Rate 5m"], 10.0 * std::exp(-0.2), 1e-6);
+	BOOST_REQUIRE_CLOSE(mpta.sendMetric_double_values["Smoothed Metric - Rate 15m"], 10.0 * std::exp(-60.0 / 900.0), 1e-6);
+
+	// Stopping reports zeros
+	mpta.stopMetrics();
+	BOOST_REQUIRE_EQUAL(mpta.sendMetric_double_values["Smoothed Metric - Rate 5m"], 0.0);
+
+	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case SendMetrics_SmoothedRate END";
+}
+
 BOOST_AUTO_TEST_CASE(StartMetrics)
 {
 	TLOG(TLVL_INFO, "MetricPlugin_t") << "Test Case StartMetrics BEGIN";